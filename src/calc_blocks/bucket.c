@@ -0,0 +1,464 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "misc.h"
+#include "wheel.h"
+#include "ctx.h"
+#include "fastmod.h"
+
+/*
+ * Bucket sieve for the large sieving primes.
+ *
+ * Once a prime is larger than the block (in numbers) it only hits a small
+ * number of blocks, so it is wasteful to look at every prime for every block.
+ * Instead each prime is kept in the bucket of the next block it hits. When a
+ * block is calculated only the primes in its bucket are touched, and each is
+ * then moved on to the bucket of the next block that it hits.
+ *
+ * The buckets form a ring indexed by block_num, large enough that a prime can
+ * never be moved past the end of the ring (ie larger than the biggest jump in
+ * bytes between multiples).
+ *
+ * The prime list is shared by the threads, kept as wheel index differences
+ * as in simple, next to the reciprocal of each prime. It is only read when a
+ * prime first reaches a thread's blocks. The buckets are per thread, and an
+ * entry (8 bytes) is the prime and the position of its next multiple, so the
+ * buckets hold each prime that is in use just once.
+ *
+ * A thread that jumps ahead to a new block moves the primes in the buckets
+ * of the skipped blocks straight to their first multiple past the jump (as
+ * skip_blocks does in lu_calc_offs), so it only starts again from the shared
+ * list if it goes backwards.
+ */
+
+
+/*
+ * a   = a_byte << 3 | a_bit   (ie the sieving prime)
+ * off = byte offset in the target block << 3 | b_bit
+ */
+struct bucket_prime
+{
+   uint32_t a;
+   uint32_t off;
+};
+
+
+#define BUCKET_CHUNK_SIZE 1023
+#define BUCKET_SLAB_SIZE  64
+
+struct bucket_chunk
+{
+   struct bucket_chunk *next;
+   uint32_t             count;
+   struct bucket_prime  primes[BUCKET_CHUNK_SIZE];
+};
+
+
+struct bucket_slab
+{
+   struct bucket_slab  *next;
+   struct bucket_chunk  chunks[BUCKET_SLAB_SIZE];
+};
+
+
+struct bucket_thread_ctx
+{
+   struct bucket_chunk **buckets;
+   struct bucket_chunk **skipped;
+   struct bucket_chunk  *free_chunks;
+   struct bucket_slab   *slabs;
+   uint32_t              calculated_index;
+   uint32_t              calculated_pp_index;
+   int64_t               last_blockno;
+};
+
+
+struct bucket_ctx
+{
+   uint32_t  start_prime;
+   uint32_t  end_prime;
+   uint32_t  block_size;
+   uint32_t  block_shift;
+   uint32_t  nbuckets;
+   int       nthreads;
+   uint8_t  *index_diffs;
+   double   *reciprocals;
+   uint32_t  first_index;
+   uint32_t  last_index;
+   uint32_t  primelist_count;
+   uint32_t  primelist_size;
+   struct bucket_thread_ctx *thread_data;
+};
+
+
+/*
+ * The byte increment to the next multiple is:
+ *    a_byte * pp_diffs[b_bit] + next_byte_diff[a_bit][b_bit]
+ *
+ * This is a_x_b_byte_diffs shifted by one, with the wrap to the next 30 being 1
+ */
+static const unsigned char next_byte_diff[8][8] = {
+   {  0, 0, 0, 0, 0, 0, 0, 1 },
+   {  1, 1, 1, 0, 1, 1, 1, 1 },
+   {  2, 2, 0, 2, 0, 2, 2, 1 },
+   {  3, 1, 1, 2, 1, 1, 3, 1 },
+   {  3, 3, 1, 2, 1, 3, 3, 1 },
+   {  4, 2, 2, 2, 2, 2, 4, 1 },
+   {  5, 3, 1, 4, 1, 3, 5, 1 },
+   {  6, 4, 2, 4, 2, 4, 6, 1 }
+};
+
+
+int
+bucket_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_prime, void **ctx)
+{
+   struct bucket_ctx *sctx = calloc(1, sizeof (struct bucket_ctx));
+   uint64_t max_jump;
+   int i;
+   *ctx = sctx;
+
+   sctx->start_prime = start_prime;
+   sctx->end_prime = MIN(pctx->run_info.max_sieve_prime, end_prime);
+   assert(start_prime >= DIV_RECIP_MIN_DIV);
+
+   sctx->block_size = pctx->current_block->block_size;
+   assert((sctx->block_size & (sctx->block_size - 1)) == 0);
+   sctx->block_shift = __builtin_ctz(sctx->block_size);
+
+   /* The biggest jump is 6 * a_byte + a few bytes. Need an extra bucket for the current block */
+   max_jump = 6ul * num_to_bytes(sctx->end_prime) + 8;
+   sctx->nbuckets = 2;
+   while (sctx->nbuckets < (max_jump >> sctx->block_shift) + 2)
+      sctx->nbuckets <<= 1;
+
+   sctx->primelist_size = 1024;
+   sctx->index_diffs = malloc(sctx->primelist_size);
+   sctx->reciprocals = malloc(sizeof(double) * sctx->primelist_size);
+
+   sctx->nthreads = pctx->num_threads ?: 1;
+   sctx->thread_data = calloc(sctx->nthreads, sizeof(struct bucket_thread_ctx));
+
+   for (i = 0; i < sctx->nthreads; i++) {
+      sctx->thread_data[i].buckets = calloc(sctx->nbuckets, sizeof(struct bucket_chunk *));
+      sctx->thread_data[i].skipped = calloc(sctx->nbuckets, sizeof(struct bucket_chunk *));
+      sctx->thread_data[i].last_blockno = INT64_MAX;
+   }
+   return 0;
+}
+
+
+int
+bucket_free(void *ctx)
+{
+   struct bucket_ctx *sctx = ctx;
+   struct bucket_slab *slab;
+   int i;
+
+   for (i = 0; i < sctx->nthreads; i++) {
+      while ((slab = sctx->thread_data[i].slabs) != NULL) {
+         sctx->thread_data[i].slabs = slab->next;
+         free(slab);
+      }
+      FREE(sctx->thread_data[i].buckets);
+      FREE(sctx->thread_data[i].skipped);
+   }
+   FREE(sctx->thread_data);
+   FREE(sctx->index_diffs);
+   FREE(sctx->reciprocals);
+   FREE(ctx);
+   return 0;
+}
+
+
+int
+bucket_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t size, void *ctx)
+{
+   struct bucket_ctx *sctx = ctx;
+   uint32_t index;
+
+   for (; *ind < size; (*ind)++) {
+      if (primelist[*ind] < sctx->start_prime)
+         continue;
+      if (primelist[*ind] > sctx->end_prime)
+         return 0;
+
+      if (sctx->primelist_count == sctx->primelist_size) {
+         sctx->primelist_size *= 2;
+         sctx->index_diffs = realloc(sctx->index_diffs, sctx->primelist_size);
+         sctx->reciprocals = realloc(sctx->reciprocals, sizeof(double) * sctx->primelist_size);
+      }
+
+      index = pp_to_index(primelist[*ind]);
+      if (sctx->primelist_count == 0)
+         sctx->first_index = sctx->last_index = index;
+
+      assert(index - sctx->last_index <= UINT8_MAX);
+      sctx->reciprocals[sctx->primelist_count] = mod_inverse(primelist[*ind]);
+      sctx->index_diffs[sctx->primelist_count++] = index - sctx->last_index;
+      sctx->last_index = index;
+   }
+   return 0;
+}
+
+
+static struct bucket_chunk *
+get_free_chunk(struct bucket_thread_ctx *tdata)
+{
+   struct bucket_chunk *chunk;
+   struct bucket_slab *slab;
+   int i;
+
+   if (tdata->free_chunks == NULL) {
+      slab = malloc(sizeof *slab);
+      slab->next = tdata->slabs;
+      tdata->slabs = slab;
+      for (i = 0; i < BUCKET_SLAB_SIZE; i++) {
+         slab->chunks[i].next = tdata->free_chunks;
+         tdata->free_chunks = &slab->chunks[i];
+      }
+   }
+
+   chunk = tdata->free_chunks;
+   tdata->free_chunks = chunk->next;
+   chunk->count = 0;
+   chunk->next = NULL;
+   return chunk;
+}
+
+
+static inline void __attribute__((always_inline))
+push_prime(struct bucket_thread_ctx *tdata, struct bucket_chunk **bucket, uint32_t a, uint32_t off)
+{
+   struct bucket_chunk *chunk = *bucket;
+
+   if (chunk == NULL || chunk->count == BUCKET_CHUNK_SIZE) {
+      chunk = get_free_chunk(tdata);
+      chunk->next = *bucket;
+      *bucket = chunk;
+   }
+   chunk->primes[chunk->count].a = a;
+   chunk->primes[chunk->count].off = off;
+   chunk->count++;
+}
+
+
+static void
+reset_buckets(struct bucket_ctx *sctx, struct bucket_thread_ctx *tdata)
+{
+   struct bucket_chunk *chunk;
+   uint32_t i;
+
+   for (i = 0; i < sctx->nbuckets; i++) {
+      while ((chunk = tdata->buckets[i]) != NULL) {
+         tdata->buckets[i] = chunk->next;
+         chunk->next = tdata->free_chunks;
+         tdata->free_chunks = chunk;
+      }
+   }
+   tdata->calculated_index = 0;
+}
+
+
+/*
+ * Mark off the multiples in the block, then move the prime
+ * to the bucket of the next block it hits.
+ */
+static inline void __attribute__((always_inline))
+sieve_prime_in_block(struct bucket_ctx *sctx, struct bucket_thread_ctx *tdata, char *block, uint64_t block_num, uint32_t a, uint64_t off, uint32_t b_bit)
+{
+   uint32_t a_byte = a >> 3;
+   uint32_t a_bit = a & 7;
+
+   while (off < sctx->block_size) {
+      block[off] |= a_x_b_bitmask[a_bit][b_bit];
+      off += (uint64_t)a_byte * pp_diffs[b_bit] + next_byte_diff[a_bit][b_bit];
+      b_bit = (b_bit + 1) & 7;
+   }
+
+   push_prime(tdata, &tdata->buckets[(block_num + (off >> sctx->block_shift)) & (sctx->nbuckets - 1)],
+              a, (off & (sctx->block_size - 1)) << 3 | b_bit);
+}
+
+
+static inline void __attribute__((always_inline))
+sieve_bucket(struct bucket_ctx *sctx, struct bucket_thread_ctx *tdata, char *block, uint64_t block_num)
+{
+   struct bucket_chunk **bucket = &tdata->buckets[block_num & (sctx->nbuckets - 1)];
+   struct bucket_chunk *chunk = *bucket;
+   struct bucket_chunk *next;
+   struct bucket_prime *bp;
+
+   /* Primes are never moved back into the bucket being sieved */
+   *bucket = NULL;
+
+   for (; chunk != NULL; chunk = next) {
+      for (bp = chunk->primes; bp < chunk->primes + chunk->count; bp++)
+         sieve_prime_in_block(sctx, tdata, block, block_num, bp->a, bp->off >> 3, bp->off & 7);
+
+      next = chunk->next;
+      chunk->next = tdata->free_chunks;
+      tdata->free_chunks = chunk;
+   }
+}
+
+
+/*
+ * Move a prime that was due at pos (bytes, negative) before the current block
+ * on to its first multiple in or after the current block. Each turn of the
+ * wheel (8 steps) moves it on by exactly the prime in bytes.
+ */
+static inline void __attribute__((always_inline))
+move_prime(struct bucket_ctx *sctx, struct bucket_thread_ctx *tdata, uint64_t block_num, uint32_t a, int64_t pos, uint32_t b_bit)
+{
+   uint32_t a_byte = a >> 3;
+   uint32_t a_bit = a & 7;
+   int64_t  turn = (int64_t)a_byte * 30 + ind_to_mod[a_bit];
+
+   pos += -pos / turn * turn;
+
+   for (; pos < 0; b_bit = (b_bit + 1) & 7)
+      pos += (uint64_t)a_byte * pp_diffs[b_bit] + next_byte_diff[a_bit][b_bit];
+
+   push_prime(tdata, &tdata->buckets[(block_num + (pos >> sctx->block_shift)) & (sctx->nbuckets - 1)],
+              a, (pos & (sctx->block_size - 1)) << 3 | b_bit);
+}
+
+
+/*
+ * Move the primes in the buckets of the skipped blocks on to the current
+ * block or later, without marking anything. The skipped buckets are all taken
+ * out of the ring first, as a prime can be moved to a bucket which shares its
+ * place in the ring with a skipped block that hasn't been looked at yet.
+ *
+ * If more blocks were skipped than there are buckets, the buckets still only
+ * hold the blocks straight after the last one.
+ */
+static void
+skip_buckets(struct bucket_ctx *sctx, struct bucket_thread_ctx *tdata, uint64_t block_num, uint64_t skip)
+{
+   uint64_t first = block_num - skip + 1;
+   uint32_t nskipped = MIN(skip - 1, sctx->nbuckets);
+   struct bucket_chunk *chunk;
+   struct bucket_chunk *next;
+   struct bucket_prime *bp;
+   int64_t  block_pos;
+   uint32_t i;
+
+   for (i = 0; i < nskipped; i++) {
+      tdata->skipped[i] = tdata->buckets[(first + i) & (sctx->nbuckets - 1)];
+      tdata->buckets[(first + i) & (sctx->nbuckets - 1)] = NULL;
+   }
+
+   for (i = 0; i < nskipped; i++) {
+      block_pos = -(int64_t)(skip - 1 - i) * sctx->block_size;
+
+      for (chunk = tdata->skipped[i]; chunk != NULL; chunk = next) {
+         for (bp = chunk->primes; bp < chunk->primes + chunk->count; bp++)
+            move_prime(sctx, tdata, block_num, bp->a, block_pos + (bp->off >> 3), bp->off & 7);
+
+         next = chunk->next;
+         chunk->next = tdata->free_chunks;
+         tdata->free_chunks = chunk;
+      }
+   }
+}
+
+
+/*
+ * Add the primes which are now <= sqrt(block_end) to the buckets. The first
+ * multiple is max(prime * prime, block_start), past prime * prime the quotient
+ * by the prime comes from its reciprocal (see fastmod.h).
+ *
+ * If mark is not set then the primes are only put in their buckets, including
+ * those that hit the current block.
+ */
+static void
+check_new_sieve_primes(struct bucket_ctx *sctx, struct bucket_thread_ctx *tdata, struct prime_current_block *pcb, const int mark)
+{
+   uint32_t sieve_prime;
+   uint32_t mod;
+   uint64_t off;
+   uint64_t b;
+   uint32_t b_bit;
+   uint32_t a_byte;
+   uint32_t a_bit;
+
+   if (tdata->calculated_index == 0)
+      tdata->calculated_pp_index = sctx->first_index;
+
+   for ( ; tdata->calculated_index < sctx->primelist_count; tdata->calculated_index++) {
+      sieve_prime = index_to_pp(tdata->calculated_pp_index + sctx->index_diffs[tdata->calculated_index]);
+
+      if (sieve_prime > pcb->sqrt_end_num)
+         return;
+
+      tdata->calculated_pp_index += sctx->index_diffs[tdata->calculated_index];
+
+      a_byte = num_to_bytes(sieve_prime);
+      a_bit  = pp_to_bit(sieve_prime);
+
+      if ((uint64_t)sieve_prime * sieve_prime >= pcb->block_start_num) {
+         b = sieve_prime;
+      }
+      else {
+         b = div_recip(pcb->block_start_num, sieve_prime, sctx->reciprocals[tdata->calculated_index], &mod);
+         b += mod != 0;
+      }
+      b_bit = mod_to_ind[b % 30];
+
+      /* a * b = a * b_byte * 30 + a_byte * b_bit_val + a_bit_val * b_bit_val */
+      off = (uint64_t)sieve_prime * num_to_bytes(b) + (uint64_t)a_byte * ind_to_mod[b_bit] + a_x_b_bytes[a_bit][b_bit] - pcb->block_start_byte;
+
+      if (mark)
+         sieve_prime_in_block(sctx, tdata, pcb->block, pcb->block_num, a_byte << 3 | a_bit, off, b_bit);
+      else
+         push_prime(tdata, &tdata->buckets[(pcb->block_num + (off >> sctx->block_shift)) & (sctx->nbuckets - 1)],
+                    a_byte << 3 | a_bit, (off & (sctx->block_size - 1)) << 3 | b_bit);
+   }
+}
+
+
+/*
+ * Fill the buckets directly for the block containing target_num, as if the
+ * previous block had just been calculated.
+ */
+int
+bucket_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
+{
+   struct bucket_ctx          *sctx = ctx;
+   struct bucket_thread_ctx   *tdata = &sctx->thread_data[pctx->thread_index];
+   struct prime_current_block  pcb = pctx->current_block;
+
+   pcb_set_block(&pcb, num_to_bytes(target_num) / pcb.block_size);
+
+   reset_buckets(sctx, tdata);
+   check_new_sieve_primes(sctx, tdata, &pcb, 0);
+   tdata->last_blockno = pcb.block_num - 1;
+   return 0;
+}
+
+
+int
+bucket_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
+{
+   struct bucket_ctx        *sctx = ctx;
+   struct bucket_thread_ctx *tdata = &sctx->thread_data[ptx->thread_index];
+   int64_t skip = ptx->current_block.block_num - tdata->last_blockno;
+
+   tdata->last_blockno = ptx->current_block.block_num;
+
+   if (sctx->primelist_count == 0)
+      return 0;
+
+   if (skip < 1)
+      reset_buckets(sctx, tdata);
+   else if (skip > 1)
+      skip_buckets(sctx, tdata, ptx->current_block.block_num, skip);
+
+   sieve_bucket(sctx, tdata, ptx->current_block.block, ptx->current_block.block_num);
+
+   check_new_sieve_primes(sctx, tdata, &ptx->current_block, 1);
+
+   return 0;
+}
@@ -2,28 +2,23 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
-#include <immintrin.h>
-#include <avx2intrin.h>
 
 #include "misc.h"
 #include "wheel.h"
 #include "ctx.h"
+#include "replica.h"
+#include "fastmod.h"
 
-#if __AVX2__
+/*
+ * The stuff is laid out for 32 byte vectors whichever clone (see misc.h) runs,
+ * without AVX2 the compiler does each vector as two halves.
+ */
 #define BPV   32
 #define WPV   16
 
 #define FV v32_16ui
 
 #define DECLV(A,B,C,D,E,F,G,H,I,J,K,L,M,N,O,P) {A,B,C,D,E,F,G,H,I,J,K,L,M,N,O,P}
-#else
-#define BPV   16
-#define WPV    8
-
-#define FV v16_8ui
-
-#define DECLV(A,B,C,D,E,F,G,H,I,J,K,L,M,N,O,P) {A,B,C,D,E,F,G,H}
-#endif
 
 /*
  * "Stuff" contains items grouped into 16 (2-byte) ints so they can be read
@@ -39,10 +34,15 @@
  *  1 * 2 * ~3500 primes =  7K
  *
  *  However, currently it is faster to store these directly.
+ *
+ * Each numa node reads its own copy of the stuff (see replica.h), and each
+ * thread allocates its own offs so they are on its node. The inverses of the
+ * primes (for mod_batch()) are only read when the offsets are set up.
  */
 struct prime_list
 {
    unsigned char *stuff;
+   double  *inverses;
    int      stuff_c;
 };
 
@@ -57,7 +57,9 @@ struct calc_offs_ctx
 {
    uint32_t start_prime;
    uint32_t end_prime;
+   uint32_t block_size;
    struct prime_list primes[8];
+   struct node_replica stuff_nodes[8];
    struct prime_offs *thread_offs;
    int nthreads;
    int blocks_per_run;
@@ -75,7 +77,13 @@ calc_offs_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_prime,
    sctx->start_prime = start_prime;
    sctx->end_prime = MIN(pctx->run_info.max_sieve_prime, end_prime);
 
-   assert(sctx->end_prime <= pctx->current_block->block_size && sctx->end_prime <= (1<<15));
+   /*
+    * Primes larger than the block mark up to a prime past either end of the
+    * block, which lands in the 32K guard areas around the block
+    */
+   assert(sctx->end_prime <= (1<<15));
+
+   sctx->block_size = pctx->current_block->block_size;
 
    sctx->nthreads = pctx->num_threads ?:1;
    sctx->blocks_per_run = pctx->blocks_per_run ?:1;
@@ -84,13 +92,10 @@ calc_offs_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_prime,
 
    for (i = 0; i < 8; i++) {
       sctx->primes[i].stuff = aligned_alloc(32, (3*sizeof(uint16_t)) * 3500);
+      sctx->primes[i].inverses = malloc(sizeof(double) * 3500);
    }
-   for (j = 0; j < sctx->nthreads; j++) {
-      for (i = 0; i < 8; i++) {
-         sctx->thread_offs[j].offs[i] = aligned_alloc(32, (sizeof(uint16_t) * 3500));
-      }
+   for (j = 0; j < sctx->nthreads; j++)
       sctx->thread_offs[j].last_blockno = INT64_MAX;
-   }
 
    return 0;
 }
@@ -103,7 +108,9 @@ calc_offs_free(void *ctx)
    int i;
    int j;
    for (i = 0; i < 8; i++) {
+      free_node_replica(&sctx->stuff_nodes[i]);
       free(sctx->primes[i].stuff);
+      free(sctx->primes[i].inverses);
    }
    for (j = 0; j < sctx->nthreads; j++) {
       for (i = 0; i < 8; i++) {
@@ -131,8 +138,9 @@ calc_offs_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t size,
       pl = &sctx->primes[pp_to_bit(primelist[*ind])];
 
       *((uint16_t *)pl->stuff + (pl->stuff_c % WPV) + (pl->stuff_c/WPV*3*WPV)) = num_to_bytes(primelist[*ind]);
-      *((uint16_t *)pl->stuff + (pl->stuff_c % WPV) + (pl->stuff_c/WPV*3*WPV)+WPV) = 32*1024/primelist[*ind];
+      *((uint16_t *)pl->stuff + (pl->stuff_c % WPV) + (pl->stuff_c/WPV*3*WPV)+WPV) = sctx->block_size/primelist[*ind];
       *((uint16_t *)pl->stuff + (pl->stuff_c % WPV) + (pl->stuff_c/WPV*3*WPV)+2*WPV) = primelist[*ind];
+      pl->inverses[pl->stuff_c] = mod_inverse(primelist[*ind]);
 
       pl->stuff_c++;
    }
@@ -140,18 +148,6 @@ calc_offs_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t size,
 }
 
 
-int
-calc_offs_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
-{
-   (void) target_num;
-
-   struct calc_offs_ctx *sctx = ctx;
-   /* Recalculate all of the offsets depending on the new block */
-   int i;
-   for (i = 0; i < 8; i++)
-      sctx->thread_offs[pctx->thread_index].offs_i[i] = 0;
-   return 0;
-}
 
 
 /*
@@ -179,23 +175,47 @@ compute_block_first_time(struct prime_current_block *pcb, uint32_t sieve_prime)
 }
 
 
+static inline uint32_t
+get_stuff_prime(const struct prime_list *pl, int ind)
+{
+   return *((uint16_t *)pl->stuff + 2*WPV + (ind%WPV) + (ind/WPV * 3*WPV));
+}
+
+
 static void
 check_new_sieve_primes_a(struct calc_offs_ctx *sctx, struct prime_current_block *pcb, struct prime_offs *offs, int skip, int mode)
 {
    uint32_t sieve_prime;
+   uint32_t primes[MOD_BATCH_SIZE];
+   uint32_t start_mods[MOD_BATCH_SIZE];
+   uint32_t skip_mods[MOD_BATCH_SIZE];
+   int batch_index;
+   int batch_n;
+   int k;
 
    int i;
    struct prime_list *pl;
    for (i = 0; i < 8; i++) {
       pl = &sctx->primes[i];
+      batch_index = batch_n = 0;
       for ( ; offs->offs_i[i] < pl->stuff_c; offs->offs_i[i]++) {
-         sieve_prime = *((uint16_t *)pl->stuff + 2*WPV + (offs->offs_i[i]%WPV) + (offs->offs_i[i]/WPV * 3*WPV));
+         sieve_prime = get_stuff_prime(pl, offs->offs_i[i]);
 
          if (mode == 0) {
             if (sieve_prime * sieve_prime >= pcb->block_start_num)
                break;
 
-            *((int16_t *)offs->offs[i] + offs->offs_i[i]) = sieve_prime - (pcb->block_start_byte - skip * pcb->block_size) % sieve_prime;
+            if (offs->offs_i[i] >= batch_index + batch_n) {
+               batch_index = offs->offs_i[i];
+               for (batch_n = 0; batch_n < MOD_BATCH_SIZE && batch_index + batch_n < pl->stuff_c; batch_n++)
+                  primes[batch_n] = get_stuff_prime(pl, batch_index + batch_n);
+               mod_batch(pcb->block_start_byte, primes, &pl->inverses[batch_index], start_mods, batch_n);
+               mod_batch(skip * pcb->block_size, primes, &pl->inverses[batch_index], skip_mods, batch_n);
+            }
+            k = offs->offs_i[i] - batch_index;
+
+            /* The block 'skip' blocks back can be before block 0 (after a skip_to) */
+            *((int16_t *)offs->offs[i] + offs->offs_i[i]) = sieve_prime - sub_mod(start_mods[k], skip_mods[k], sieve_prime);
          }
          else {
             if (sieve_prime > pcb->sqrt_end_num)
@@ -208,19 +228,105 @@ check_new_sieve_primes_a(struct calc_offs_ctx *sctx, struct prime_current_block
 }
 
 
+static struct prime_offs *
+get_thread_offs(struct calc_offs_ctx *sctx, uint32_t thread_index)
+{
+   struct prime_offs *po = &sctx->thread_offs[thread_index];
+   int i;
+
+   if (po->offs[0] == NULL)
+      for (i = 0; i < 8; i++)
+         po->offs[i] = aligned_alloc(32, (sizeof(uint16_t) * 3500));
+   return po;
+}
+
+
+static inline const unsigned char *
+get_stuff(struct calc_offs_ctx *sctx, struct prime_thread_ctx *ptx, int bit)
+{
+   struct prime_list *pl = &sctx->primes[bit];
+
+   return get_node_replica(&sctx->stuff_nodes[bit], ptx, pl->stuff, CEIL_DIV(pl->stuff_c, WPV) * 3 * WPV * sizeof(uint16_t));
+}
+
+
+/*
+ * Calculate the offsets directly for the block containing target_num. These
+ * are stored as if the previous block had just been calculated, so the next
+ * call to calc_primes (with the target block) carries on without a reset.
+ */
+int
+calc_offs_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
+{
+   struct calc_offs_ctx *sctx = ctx;
+   struct prime_offs *po = get_thread_offs(sctx, pctx->thread_index);
+   struct prime_current_block pcb = pctx->current_block;
+
+   pcb_set_block(&pcb, num_to_bytes(target_num) / pcb.block_size);
+
+   memset(po->offs_i, 0, sizeof po->offs_i);
+   check_new_sieve_primes_a(sctx, &pcb, po, 1, 0);
+   po->last_blockno = pcb.block_num - 1;
+   return 0;
+}
+
+
+/*
+ * Move the offsets on past 'skip' blocks in one go, for skips too long to
+ * step through a block at a time in get_offs_a(). Each block takes the
+ * block size (mod the prime) off a prime's offset. A negative skip puts it
+ * back on, which is the same as taking off the prime less that.
+ */
+static void
+skip_blocks_a(struct calc_offs_ctx *sctx, struct prime_thread_ctx *ptx, struct prime_offs *po, int64_t skip)
+{
+   uint64_t        bytes = (skip < 0 ? -skip : skip) * ptx->current_block.block_size;
+   const uint16_t *stuff;
+   uint16_t       *offs;
+   uint32_t        primes[MOD_BATCH_SIZE];
+   uint32_t        mods[MOD_BATCH_SIZE];
+   int             bit;
+   int             i;
+   int             n;
+   int             k;
+
+   for (bit = 0; bit < 8; bit++) {
+      stuff = (const uint16_t *)get_stuff(sctx, ptx, bit);
+      offs = (uint16_t *)po->offs[bit];
+
+      for (i = 0; i < po->offs_i[bit]; i += n) {
+         n = MIN(MOD_BATCH_SIZE, po->offs_i[bit] - i);
+         for (k = 0; k < n; k++)
+            primes[k] = stuff[2*WPV + (i+k)%WPV + (i+k)/WPV*3*WPV];
+         mod_batch(bytes, primes, &sctx->primes[bit].inverses[i], mods, n);
+         if (skip < 0)
+            for (k = 0; k < n; k++)
+               mods[k] = mods[k] ? primes[k] - mods[k] : 0;
+
+         /* An offset can be the prime itself */
+         for (k = 0; k < n; k++)
+            offs[i + k] = sub_mod(offs[i + k] - (offs[i + k] >= primes[k] ? primes[k] : 0), mods[k], primes[k]);
+      }
+   }
+}
+
+
+/*
+ * The offset of the last multiple is stored relative to block + n * prime so
+ * it fits in 16 bits for any block size. r is block_size - n * prime, so the
+ * multiple at n * prime is only in the block if o < r.
+ */
 static inline void __attribute__((always_inline))
-adjust_offsets(FV *curoffs, FV *ns, FV *primes, FV *bs, FV *o, int ind)
+adjust_offsets(FV *curoffs, FV *primes, FV *r, FV *o, int ind)
 {
    *o -= (*o >= *primes) & *primes;
    curoffs[ind] = *o;
-   *o += *ns * *primes;
-   *o -= (*o >= *bs) & *primes;
-   curoffs[8 + ind] = *o;
+   curoffs[8 + ind] = *o - ((*o >= *r) & *primes);
 }
 
 
 static inline void __attribute__((always_inline))
-get_offs_a(struct calc_offs_ctx *ctx __attribute__((unused)), FV *ap, FV *pp, FV *np, FV *op, FV *curoffs, int skip, const int bit)
+get_offs_a(struct calc_offs_ctx *ctx, FV *ap, FV *pp, FV *np, FV *op, FV *curoffs, int skip, const int bit)
 {
    FV a_bytes = *ap;
    FV ns = *np;
@@ -234,18 +340,22 @@ get_offs_a(struct calc_offs_ctx *ctx __attribute__((unused)), FV *ap, FV *pp, FV
    FV v_offsets_6;
    FV v_offsets_7;
    FV ones = DECLV(1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1);
+   FV wrap;
 
-   /* XXX hardcoded for now */
-   FV bs = DECLV(32*1024,32*1024,32*1024,32*1024,32*1024,32*1024,32*1024,32*1024,
-                 32*1024,32*1024,32*1024,32*1024,32*1024,32*1024,32*1024,32*1024);
+   /*
+    * r = block_size - n * prime, which is < prime. This is done mod 2^16 so
+    * works for blocks larger than 64K
+    */
+   FV r = (uint16_t)ctx->block_size - ns * primes;
 
    /*
     * Calculate (and store) the new offsets based on how many blocks have been
     * skipped
     */
    while (skip--) {
-      *op -= bs - ns * primes;
-      *op += (*op > bs) & primes;  /* unsigned so this detects the wrap */
+      wrap = *op < r;
+      *op -= r;
+      *op += wrap & primes;
    }
 
 
@@ -359,14 +469,14 @@ get_offs_a(struct calc_offs_ctx *ctx __attribute__((unused)), FV *ap, FV *pp, FV
    }
 
 
-   adjust_offsets(curoffs, &ns, &primes, &bs, &v_offsets_0, 0);
-   adjust_offsets(curoffs, &ns, &primes, &bs, &v_offsets_1, 1);
-   adjust_offsets(curoffs, &ns, &primes, &bs, &v_offsets_2, 2);
-   adjust_offsets(curoffs, &ns, &primes, &bs, &v_offsets_3, 3);
-   adjust_offsets(curoffs, &ns, &primes, &bs, &v_offsets_4, 4);
-   adjust_offsets(curoffs, &ns, &primes, &bs, &v_offsets_5, 5);
-   adjust_offsets(curoffs, &ns, &primes, &bs, &v_offsets_6, 6);
-   adjust_offsets(curoffs, &ns, &primes, &bs, &v_offsets_7, 7);
+   adjust_offsets(curoffs, &primes, &r, &v_offsets_0, 0);
+   adjust_offsets(curoffs, &primes, &r, &v_offsets_1, 1);
+   adjust_offsets(curoffs, &primes, &r, &v_offsets_2, 2);
+   adjust_offsets(curoffs, &primes, &r, &v_offsets_3, 3);
+   adjust_offsets(curoffs, &primes, &r, &v_offsets_4, 4);
+   adjust_offsets(curoffs, &primes, &r, &v_offsets_5, 5);
+   adjust_offsets(curoffs, &primes, &r, &v_offsets_6, 6);
+   adjust_offsets(curoffs, &primes, &r, &v_offsets_7, 7);
 }
 
 
@@ -388,10 +498,11 @@ mark_16_a (struct prime_current_block *pcb, uint16_t *offs_orig, uint16_t *prime
             *(bmp + *(offs + j*WPV)) |= bits[j];
    }
    offs = offs_orig + WPV*8;
-   bmp = pcb->block;
-   for (i = 0; i < nconsume; i++, offs++)
+   for (i = 0; i < nconsume; i++, offs++) {
+      bmp = pcb->block + ns[i] * primes[i];
       for (j = 0; j < 8; j++)
-         *(bmp + *(offs + j*WPV)) |= bits[j];
+         *(bmp + *(int16_t *)(offs + j*WPV)) |= bits[j];
+   }
 }
 
 
@@ -401,16 +512,16 @@ mark_16_a (struct prime_current_block *pcb, uint16_t *offs_orig, uint16_t *prime
  * I'm not entirely sure what gcc does here but it seems to be a sizeable boost
  * (over explicitely inlining or not inlining)
  */
-static void
-do_bit_a(struct calc_offs_ctx *ctx, struct prime_current_block *pcb, struct prime_offs *po, int skip, const int bit)
+static void KERNEL_CLONES
+do_bit_a(struct calc_offs_ctx *ctx, struct prime_current_block *pcb, struct prime_offs *po, const unsigned char *stuff, int skip, const int bit)
 {
    unsigned char buf[BPV*16] __attribute__((aligned(BPV)));
-   FV *ap = (FV *)ctx->primes[bit].stuff;
+   FV *ap = (FV *)stuff;
    FV *op = (FV *)po->offs[bit];
    uint16_t *offs;
 
-   uint16_t *primep = (uint16_t *)ctx->primes[bit].stuff + WPV*2;
-   uint16_t *np = (uint16_t *)ctx->primes[bit].stuff + WPV;
+   uint16_t *primep = (uint16_t *)stuff + WPV*2;
+   uint16_t *np = (uint16_t *)stuff + WPV;
 
    int k = po->offs_i[bit]/WPV + 1;
    int i = po->offs_i[bit] % WPV;
@@ -453,28 +564,39 @@ int
 calc_offs_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
 {
    struct calc_offs_ctx *sctx = ctx;
-   struct prime_offs *po = &sctx->thread_offs[ptx->thread_index];
+   struct prime_offs *po = get_thread_offs(sctx, ptx->thread_index);
    int64_t skip = ptx->current_block.block_num - po->last_blockno;
+   int     restart = po->last_blockno == INT64_MAX || ptx->current_block.block_start_num <= sctx->end_prime;
 
    po->last_blockno = ptx->current_block.block_num;
 
-   if (skip < 0 || skip > 8) {
+   /*
+    * Going back (eg a stolen run behind this one) keeps the offsets unless it
+    * is the thread's first block or the block has the primes themselves in
+    * it, which would be marked off. Primes past the new sqrt(block_end) only
+    * mark off composites.
+    */
+   if (skip < 0 && restart) {
       memset(po->offs_i, 0, sizeof po->offs_i);
       skip = 0;
    }
+   else if (skip < 0 || skip > 8) {
+      skip_blocks_a(sctx, ptx, po, skip);
+      skip = 0;
+   }
 
-   check_new_sieve_primes_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 0);
+   check_new_sieve_primes_a(sctx, &ptx->current_block, po, skip, 0);
 
-   do_bit_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 0);
-   do_bit_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 1);
-   do_bit_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 2);
-   do_bit_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 3);
-   do_bit_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 4);
-   do_bit_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 5);
-   do_bit_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 6);
-   do_bit_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 7);
+   do_bit_a(sctx, &ptx->current_block, po, get_stuff(sctx, ptx, 0), skip, 0);
+   do_bit_a(sctx, &ptx->current_block, po, get_stuff(sctx, ptx, 1), skip, 1);
+   do_bit_a(sctx, &ptx->current_block, po, get_stuff(sctx, ptx, 2), skip, 2);
+   do_bit_a(sctx, &ptx->current_block, po, get_stuff(sctx, ptx, 3), skip, 3);
+   do_bit_a(sctx, &ptx->current_block, po, get_stuff(sctx, ptx, 4), skip, 4);
+   do_bit_a(sctx, &ptx->current_block, po, get_stuff(sctx, ptx, 5), skip, 5);
+   do_bit_a(sctx, &ptx->current_block, po, get_stuff(sctx, ptx, 6), skip, 6);
+   do_bit_a(sctx, &ptx->current_block, po, get_stuff(sctx, ptx, 7), skip, 7);
 
-   check_new_sieve_primes_a(sctx, &ptx->current_block, &sctx->thread_offs[ptx->thread_index], skip, 1);
+   check_new_sieve_primes_a(sctx, &ptx->current_block, po, skip, 1);
 
    return 0;
 }
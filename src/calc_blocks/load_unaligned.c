@@ -3,17 +3,25 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
-#include <immintrin.h>
 
 #include "misc.h"
 #include "wheel.h"
 #include "ctx.h"
 
+/*
+ * The bytes of 7, 11, 13 and 17 together repeat every 7*11*13*17 bytes, so a
+ * block can start as a copy of the right part of them instead of four passes.
+ * With 19 as well it would be 316K, more than it saves once it is out of L2.
+ */
+#define PRESIEVE_BYTES (7*11*13*17)
+
 struct load_unaligned_ctx
 {
    uint32_t start_prime;
    uint32_t end_prime;
 
+   unsigned char *presieve;   /* NULL unless 7 to 17 are all done here */
+
    unsigned char pbuf1_7[8*32]   __attribute__((aligned(32)));
    unsigned char pbuf1_11[12*32] __attribute__((aligned(32)));
    unsigned char pbuf1_13[14*32] __attribute__((aligned(32)));
@@ -26,6 +34,7 @@ struct load_unaligned_ctx
 
 #define PRIMES_1_to_16  7,11,13
 #define PRIMES_16_to_32 17,19,23,29,31
+#define PRIMES_19_to_32 19,23,29,31
 #define PRIMES_32_to_64 37,41,43,47,53,59,61
 #define PRIMES_64_to_96 67,71,73,79,83,89
 
@@ -90,6 +99,26 @@ load_unaligned_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_p
 
    DO_FOR( INIT_BIN_4, PRIMES_64_to_96)
 
+   sctx->presieve = NULL;
+   if (sctx->start_prime <= 7 && sctx->end_prime >= 17) {
+      uint64_t *words = aligned_alloc(64, CEIL_TO(PRESIEVE_BYTES, 64));
+      uint64_t *tmp = malloc(CEIL_TO(PRESIEVE_BYTES, 64));
+      uint32_t num = CEIL_DIV(PRESIEVE_BYTES, 8);
+      uint32_t k;
+
+      memset(words, 0, num * sizeof(uint64_t));
+
+#define INIT_PRESIEVE(PRIME) \
+      init_early_prime_a(0ul, PRIME, tmp, num); \
+      for (k = 0; k < num; k++) \
+         words[k] |= tmp[k];
+
+      DO_FOR( INIT_PRESIEVE, PRIMES_1_to_16, 17)
+
+      free(tmp);
+      sctx->presieve = (unsigned char *)words;
+   }
+
    return 0;
 }
 
@@ -98,6 +127,7 @@ int
 load_unaligned_free(void *ctx)
 {
    struct load_unaligned_ctx *sctx = ctx;
+   FREE(sctx->presieve);
    bzero(sctx, sizeof *sctx);
    FREE(ctx);
    return 0;
@@ -133,10 +163,8 @@ load_unaligned_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void
  * DECL_LOAD_UNALIGNED(VAL, PRIME)
  *    VAL    is used to differentiate different variable names, and is also used as the offset to perform the load (VAL * 32)
  *    PRIME  is used to refer to the table to load from, and also to calculate the mod which gives the initial offset
- *
- * NOTE: I could not get the gcc vectors to perform an unaligned load, so reverted to _mm256 intrinsics
  */
-#define DECL_LOAD_UNALIGNED(VAL, PRIME) v32ui l##VAL = (v32ui)_mm256_loadu_si256((__m256i *)(ctx->pbuf1_##PRIME + VAL * 32 + (pcb->block_start_num / 30) % PRIME));
+#define DECL_LOAD_UNALIGNED(VAL, PRIME) v32ui l##VAL = LOAD_V32(ctx->pbuf1_##PRIME + VAL * 32 + (pcb->block_start_num / 30) % PRIME);
 #define DECL_7(VAL)  DECL_LOAD_UNALIGNED(VAL, 7)
 #define DECL_11(VAL) DECL_LOAD_UNALIGNED(VAL, 11)
 #define DECL_13(VAL) DECL_LOAD_UNALIGNED(VAL, 13)
@@ -144,7 +172,7 @@ load_unaligned_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void
 #define APPLY_SET(VAL) *out++ = l##VAL;
 #define APPLY_OR(VAL) *out++ |= l##VAL;
 
-static void
+static void KERNEL_CLONES
 do_early_prime_group_1_7 (struct load_unaligned_ctx *ctx, struct prime_current_block *pcb)
 {
    int c = CEIL_DIV(pcb->block_size, 32*7);
@@ -158,7 +186,7 @@ do_early_prime_group_1_7 (struct load_unaligned_ctx *ctx, struct prime_current_b
 }
 
 
-static void
+static void KERNEL_CLONES
 do_early_prime_group_1_11 (struct load_unaligned_ctx *ctx, struct prime_current_block *pcb)
 {
    int c = CEIL_DIV(pcb->block_size, 32*11);
@@ -172,7 +200,7 @@ do_early_prime_group_1_11 (struct load_unaligned_ctx *ctx, struct prime_current_
 }
 
 
-static void
+static void KERNEL_CLONES
 do_early_prime_group_1_13 (struct load_unaligned_ctx *ctx, struct prime_current_block *pcb)
 {
    int c = CEIL_DIV(pcb->block_size, 32*13);
@@ -187,32 +215,58 @@ do_early_prime_group_1_13 (struct load_unaligned_ctx *ctx, struct prime_current_
 
 
 static void
-do_early_prime_group_2(struct load_unaligned_ctx *sctx, struct prime_current_block *pcb)
+do_presieve (struct load_unaligned_ctx *ctx, struct prime_current_block *pcb)
 {
-   int n = CEIL_DIV(pcb->block_size, 32);
-   v32ui *out = (v32ui *)__builtin_assume_aligned(pcb->block, 512);
-   int i = 0;
+   unsigned char *out = (unsigned char *)pcb->block;
+   uint32_t left = pcb->block_size;
+   uint32_t c = (pcb->block_start_num / 30) % PRESIEVE_BYTES;
+   uint32_t n;
+
+   while (left) {
+      n = MIN(left, PRESIEVE_BYTES - c);
+      memcpy(out, ctx->presieve + c, n);
+      out += n;
+      left -= n;
+      c = 0;
+   }
+}
+
+
+/*
+ * FIRST is the index in pbuf2 of the first prime, 17 is left out when it is
+ * in the presieve.
+ */
+#define DEF_EARLY_PRIME_GROUP_2(NAME, FIRST, ...) \
+static void KERNEL_CLONES \
+NAME (struct load_unaligned_ctx *sctx, struct prime_current_block *pcb) \
+{ \
+   int n = CEIL_DIV(pcb->block_size, 32); \
+   v32ui *out = (v32ui *)__builtin_assume_aligned(pcb->block, 512); \
+   int i = FIRST; \
+ \
+   DO_FOR(DEC_X_V32_B, __VA_ARGS__) \
+ \
+   while (n--) { \
+      DO_FOR(OR_PRIME, __VA_ARGS__) \
+      out++; \
+   } \
+}
 
 #define DEC_X_V32_B(PRIME) \
    int c##PRIME = (pcb->block_start_num / 30) % PRIME; \
    unsigned char lp_##PRIME [2*32] __attribute__((aligned(32))); \
    memcpy(lp_##PRIME, &sctx->pbuf2[i++][0], sizeof lp_##PRIME);
 
-   DO_FOR(DEC_X_V32_B, PRIMES_16_to_32)
-
 #define OR_PRIME(PRIME) \
-      *out |= (v32ui)_mm256_loadu_si256((__m256i *)((char *)lp_##PRIME+c##PRIME)); \
+      *out |= LOAD_V32((char *)lp_##PRIME+c##PRIME); \
       c##PRIME += (32 - PRIME); \
       c##PRIME -= c##PRIME >= PRIME ? PRIME : 0; \
 
-   while (n--) {
-      DO_FOR(OR_PRIME, PRIMES_16_to_32)
-      out++;
-   }
-}
+DEF_EARLY_PRIME_GROUP_2(do_early_prime_group_2, 0, PRIMES_16_to_32)
+DEF_EARLY_PRIME_GROUP_2(do_early_prime_group_2_from_19, 1, PRIMES_19_to_32)
 
 
-static void
+static void KERNEL_CLONES
 do_early_prime_group_3(struct load_unaligned_ctx *sctx, struct prime_current_block *pcb)
 {
    int n = CEIL_DIV(pcb->block_size, 64);
@@ -227,8 +281,8 @@ do_early_prime_group_3(struct load_unaligned_ctx *sctx, struct prime_current_blo
    DO_FOR(DEC_X_V32_C, PRIMES_32_to_64)
 
 #define OR_PRIME_C(PRIME) \
-      *out        |= (v32ui)_mm256_loadu_si256((__m256i *)((char *)lp_##PRIME + c##PRIME)); \
-      *(out + 1)  |= (v32ui)_mm256_loadu_si256((__m256i *)((char *)lp_##PRIME + c##PRIME + 32)); \
+      *out        |= LOAD_V32((char *)lp_##PRIME + c##PRIME); \
+      *(out + 1)  |= LOAD_V32((char *)lp_##PRIME + c##PRIME + 32); \
       c##PRIME += (64 - PRIME); \
       c##PRIME -= c##PRIME >= PRIME ? PRIME : 0; \
 
@@ -239,7 +293,7 @@ do_early_prime_group_3(struct load_unaligned_ctx *sctx, struct prime_current_blo
 }
 
 
-static void
+static void KERNEL_CLONES
 do_early_prime_group_4(struct load_unaligned_ctx *sctx, struct prime_current_block *pcb)
 {
    int n = CEIL_DIV(pcb->block_size,96);
@@ -254,9 +308,9 @@ do_early_prime_group_4(struct load_unaligned_ctx *sctx, struct prime_current_blo
    DO_FOR(DEC_X_V32_D, PRIMES_64_to_96)
 
 #define OR_PRIME_D(PRIME) \
-      *out        |= (v32ui)_mm256_loadu_si256((__m256i *)((char *)lp_##PRIME + c##PRIME)); \
-      *(out + 1)  |= (v32ui)_mm256_loadu_si256((__m256i *)((char *)lp_##PRIME + c##PRIME + 32)); \
-      *(out + 2)  |= (v32ui)_mm256_loadu_si256((__m256i *)((char *)lp_##PRIME + c##PRIME + 64)); \
+      *out        |= LOAD_V32((char *)lp_##PRIME + c##PRIME); \
+      *(out + 1)  |= LOAD_V32((char *)lp_##PRIME + c##PRIME + 32); \
+      *(out + 2)  |= LOAD_V32((char *)lp_##PRIME + c##PRIME + 64); \
       c##PRIME += (96 - PRIME); \
       c##PRIME -= c##PRIME >= PRIME ? PRIME : 0; \
 
@@ -275,17 +329,23 @@ load_unaligned_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
 
    /* Note the conditional checks means that another method be used to, say, calculate primes 32-64 */
 
-   if (sctx->start_prime <=7 && sctx->end_prime >= 7)
-      do_early_prime_group_1_7 (sctx, &ptx->current_block);
+   if (sctx->presieve) {
+      do_presieve (sctx, &ptx->current_block);
+      do_early_prime_group_2_from_19(sctx, &ptx->current_block);
+   }
+   else {
+      if (sctx->start_prime <=7 && sctx->end_prime >= 7)
+         do_early_prime_group_1_7 (sctx, &ptx->current_block);
 
-   if (sctx->start_prime <= 11 && sctx->end_prime >= 11)
-      do_early_prime_group_1_11 (sctx, &ptx->current_block);
+      if (sctx->start_prime <= 11 && sctx->end_prime >= 11)
+         do_early_prime_group_1_11 (sctx, &ptx->current_block);
 
-   if (sctx->start_prime <= 13 && sctx->end_prime >= 13)
-      do_early_prime_group_1_13 (sctx, &ptx->current_block);
+      if (sctx->start_prime <= 13 && sctx->end_prime >= 13)
+         do_early_prime_group_1_13 (sctx, &ptx->current_block);
 
-   if (sctx->start_prime < 32 && sctx->end_prime >= 17)
-      do_early_prime_group_2(sctx, &ptx->current_block);
+      if (sctx->start_prime < 32 && sctx->end_prime >= 17)
+         do_early_prime_group_2(sctx, &ptx->current_block);
+   }
 
    if (sctx->start_prime < 64 && sctx->end_prime > 32)
       do_early_prime_group_3(sctx, &ptx->current_block);
@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "misc.h"
+#include "wheel.h"
+#include "ctx.h"
+#include "fastmod.h"
+
+
+/*
+ * Target 96 - 256, using the abit trick
+ *
+ * For each of the 8 output bits the block is looked at as a bit plane, ie
+ * each byte is now a bit. A prime sets every prime'th bit of each plane (its
+ * multiples with that bit are 30 * prime apart), starting from a different
+ * place in each plane.
+ *
+ * The block is done 256 bytes at a time, with a ymm register per plane. Bit g
+ * of byte m in the register is byte m + 32 * g of the 256, so the 8 planes
+ * are turned back into 8 x 32 bytes by transposing the 8 x 8 bits in each of
+ * the 32 byte positions (3 rounds of swaps over the 8 registers).
+ *
+ * In that layout byte m of a plane only depends on (start + m) mod prime, so
+ * each prime keeps the bytes for 0 .. prime - 1 (plus 32) and the register is
+ * an unaligned load from them, as in load_unaligned. The start moves on by
+ * 256 mod prime for the next 256 bytes. All the primes are ORed into the 8
+ * registers before they are written, so the block is only touched once.
+ *
+ * Nothing is kept between blocks, the starts come from the block's start mod
+ * each prime. Multiples below prime * prime are marked too, but they are all
+ * composite apart from the prime itself, which is put back in the first block.
+ */
+
+/* Primes to 256 (from 7) fit in a mod_batch() */
+#define LOWER_MIDDLE_MAX_PRIME 256
+#define LOWER_MIDDLE_MAX_PRIMES MOD_BATCH_SIZE
+
+#define CHUNK_BYTES 256
+
+
+struct lower_middle_ctx
+{
+   uint32_t start_prime;
+   uint32_t end_prime;
+   uint32_t count;
+
+   uint32_t primes[LOWER_MIDDLE_MAX_PRIMES];
+   double   inverses[LOWER_MIDDLE_MAX_PRIMES];
+   uint32_t advance[LOWER_MIDDLE_MAX_PRIMES];        /* 256 mod prime */
+   uint32_t plane_start[LOWER_MIDDLE_MAX_PRIMES][8]; /* First byte with the bit, mod prime */
+
+   /* Each prime's prime + 32 bytes, every 32 bytes */
+   unsigned char *patterns[LOWER_MIDDLE_MAX_PRIMES];
+};
+
+
+int
+lower_middle_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_prime, void **ctx)
+{
+   struct lower_middle_ctx *sctx = calloc(sizeof (struct lower_middle_ctx), 1);
+   *ctx = sctx;
+
+   sctx->start_prime = start_prime;
+   sctx->end_prime = MIN(pctx->run_info.max_sieve_prime, end_prime);
+
+   assert(sctx->start_prime >= 7);
+   assert(sctx->end_prime <= LOWER_MIDDLE_MAX_PRIME);
+   assert(pctx->current_block->block_size % CHUNK_BYTES == 0);
+
+   return 0;
+}
+
+
+int
+lower_middle_free(void *ctx)
+{
+   struct lower_middle_ctx *sctx = ctx;
+   uint32_t i;
+
+   for (i = 0; i < sctx->count; i++)
+      free(sctx->patterns[i]);
+   FREE(ctx);
+   return 0;
+}
+
+
+/*
+ * Byte y of the pattern has bit g set if byte y + 32 * g is a multiple,
+ * counting from a multiple at byte 0.
+ */
+static unsigned char *
+make_pattern(uint32_t prime)
+{
+   unsigned char *pattern = calloc(CEIL_TO(prime + 32, 32), 1);
+   uint32_t y;
+   uint32_t g;
+
+   for (y = 0; y < prime + 32; y++)
+      for (g = 0; g < 8; g++)
+         if ((y + 32 * g) % prime == 0)
+            pattern[y] |= 1 << g;
+   return pattern;
+}
+
+
+int
+lower_middle_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t size, void *ctx)
+{
+   struct lower_middle_ctx *sctx = ctx;
+   uint32_t prime;
+   uint32_t mult;
+   int      k;
+
+   for (; *ind < size; (*ind)++) {
+      prime = primelist[*ind];
+      if (prime < sctx->start_prime)
+         continue;
+      if (prime > sctx->end_prime)
+         return 0;
+
+      assert(sctx->count < LOWER_MIDDLE_MAX_PRIMES);
+
+      /* prime * 1 .. prime * 29 are all in the first prime bytes */
+      for (k = 0; k < 8; k++) {
+         mult = prime * ind_to_mod[k];
+         sctx->plane_start[sctx->count][pp_to_bit(mult)] = num_to_bytes(mult);
+      }
+
+      sctx->primes[sctx->count] = prime;
+      sctx->inverses[sctx->count] = mod_inverse(prime);
+      sctx->advance[sctx->count] = CHUNK_BYTES % prime;
+      sctx->patterns[sctx->count] = make_pattern(prime);
+      sctx->count++;
+   }
+   return 0;
+}
+
+
+/* The starts are worked out from each block's start, so there is nothing to do */
+int
+lower_middle_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
+{
+   (void)pctx;
+   (void)target_num;
+   (void)ctx;
+
+   return 0;
+}
+
+
+/* Swap bits g + D of A with bits g of B, for the g in each byte without D */
+#define SWAP_BITS(A, B, D, M) \
+   t = ((A >> D) ^ B) & M; \
+   B ^= t; \
+   A ^= t << D;
+
+/*
+ * planes[b] byte m bit g is bit b of byte m + 32 * g, after this planes[g]
+ * byte m bit b is. It is the usual 8 x 8 bit transpose, for each byte.
+ */
+static inline void __attribute__((always_inline))
+transpose_planes(v32_8ui *planes)
+{
+   const v32_8ui m4 = {0x0F0F0F0F,0x0F0F0F0F,0x0F0F0F0F,0x0F0F0F0F,0x0F0F0F0F,0x0F0F0F0F,0x0F0F0F0F,0x0F0F0F0F};
+   const v32_8ui m2 = {0x33333333,0x33333333,0x33333333,0x33333333,0x33333333,0x33333333,0x33333333,0x33333333};
+   const v32_8ui m1 = {0x55555555,0x55555555,0x55555555,0x55555555,0x55555555,0x55555555,0x55555555,0x55555555};
+   v32_8ui t;
+
+   SWAP_BITS(planes[0], planes[4], 4, m4)
+   SWAP_BITS(planes[1], planes[5], 4, m4)
+   SWAP_BITS(planes[2], planes[6], 4, m4)
+   SWAP_BITS(planes[3], planes[7], 4, m4)
+
+   SWAP_BITS(planes[0], planes[2], 2, m2)
+   SWAP_BITS(planes[1], planes[3], 2, m2)
+   SWAP_BITS(planes[4], planes[6], 2, m2)
+   SWAP_BITS(planes[5], planes[7], 2, m2)
+
+   SWAP_BITS(planes[0], planes[1], 1, m1)
+   SWAP_BITS(planes[2], planes[3], 1, m1)
+   SWAP_BITS(planes[4], planes[5], 1, m1)
+   SWAP_BITS(planes[6], planes[7], 1, m1)
+}
+
+
+/*
+ * Two primes' starts for the 8 planes, so a register moves them both on.
+ * An odd prime out is paired with nothing (an empty pattern, which stays
+ * at 0).
+ */
+struct prime_pair
+{
+   v32_16si starts;
+   v32_16si advance;
+   v32_16si primes;
+   const unsigned char *pattern[2];
+};
+
+
+static const unsigned char no_pattern[32];
+
+
+#define ZERO_PLANE(B) \
+      planes[B] = (v32_8ui){0};
+
+/* The starts are read 4 at a time, to leave the loads for the patterns */
+#define OR_PLANE(B) \
+      planes[B] |= (v32_8ui)LOAD_V32(pattern + (uint16_t)(starts[B / 4] >> (B % 4 * 16)));
+
+#define WRITE_PLANE(B) \
+      out[B] |= planes[B];
+
+static void KERNEL_CLONES
+sieve_block(struct prime_current_block *pcb, struct prime_pair *pairs, uint32_t npairs)
+{
+   v32_8ui *out = (v32_8ui *)__builtin_assume_aligned(pcb->block, 512);
+   int      n = pcb->block_size / CHUNK_BYTES;
+   v32_8ui  planes[8];
+   v32_16si next;
+   uint64_t starts[2];
+   const unsigned char *pattern;
+   struct prime_pair *pp;
+
+   while (n--) {
+      DO_FOR(ZERO_PLANE, 0,1,2,3,4,5,6,7)
+
+      for (pp = pairs; pp < pairs + npairs; pp++) {
+         starts[0] = ((v32_4ui)pp->starts)[0];
+         starts[1] = ((v32_4ui)pp->starts)[1];
+         pattern = pp->pattern[0];
+         DO_FOR(OR_PLANE, 0,1,2,3,4,5,6,7)
+
+         starts[0] = ((v32_4ui)pp->starts)[2];
+         starts[1] = ((v32_4ui)pp->starts)[3];
+         pattern = pp->pattern[1];
+         DO_FOR(OR_PLANE, 0,1,2,3,4,5,6,7)
+
+         next = pp->starts + pp->advance;
+         next -= (next >= pp->primes) & pp->primes;
+         pp->starts = next;
+      }
+
+      transpose_planes(planes);
+
+      DO_FOR(WRITE_PLANE, 0,1,2,3,4,5,6,7)
+      out += 8;
+   }
+}
+
+
+int
+lower_middle_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
+{
+   struct lower_middle_ctx    *sctx = ctx;
+   struct prime_current_block *pcb = &ptx->current_block;
+   struct prime_pair pairs[LOWER_MIDDLE_MAX_PRIMES / 2];
+   struct prime_pair *pp;
+   uint32_t mods[LOWER_MIDDLE_MAX_PRIMES];
+   uint32_t prime;
+   uint32_t i;
+   int      h;
+   int      b;
+
+   if (sctx->count == 0)
+      return 0;
+
+   /* The start of the block in each plane, mod the prime */
+   mod_batch(pcb->block_start_byte, sctx->primes, sctx->inverses, mods, sctx->count);
+
+   memset(pairs, 0, sizeof pairs);
+   for (i = 0; i < CEIL_TO(sctx->count, 2); i++) {
+      pp = &pairs[i / 2];
+      h = i % 2;
+      pp->pattern[h] = no_pattern;
+      if (i == sctx->count)
+         continue;
+
+      prime = sctx->primes[i];
+      pp->pattern[h] = sctx->patterns[i];
+      for (b = 0; b < 8; b++) {
+         pp->starts[h * 8 + b] = sub_mod(mods[i], sctx->plane_start[i][b], prime);
+         pp->advance[h * 8 + b] = sctx->advance[i];
+         pp->primes[h * 8 + b] = prime;
+      }
+   }
+
+   sieve_block(pcb, pairs, CEIL_DIV(sctx->count, 2));
+
+   /* The primes themselves are in the first block */
+   if (pcb->block_start_byte == 0)
+      for (i = 0; i < sctx->count; i++)
+         pcb->block[num_to_bytes(sctx->primes[i])] &= ~(1 << pp_to_bit(sctx->primes[i]));
+
+   return 0;
+}
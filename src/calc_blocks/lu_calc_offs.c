@@ -2,34 +2,58 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h> /* XXX Debug */
-#include <immintrin.h>
-#include <avx2intrin.h>
 
 #include "misc.h"
 #include "wheel.h"
 #include "ctx.h"
+#include "replica.h"
+#include "fastmod.h"
 
 
 /*
- * Was trying to make this 4 bytes. It can fit but it was taking too long to extract
+ * The offset is under the block size plus one step of a prime (the primes
+ * here are under 900000), so it fits in 29 bits next to the ind. Both are
+ * written at once as a struct so the stores aren't read-modify-write.
  */
-struct prime_and_offset
+struct ind_and_offset
 {
-   uint8_t ind;
-   uint8_t a_byte_diff;
-   uint32_t offset;
-}__attribute__((__packed__));
+   uint32_t ind : 3;
+   uint32_t offset : 29;
+};
 
 
+/*
+ * The primes with the same a_bit, stored as the differences of their a_byte.
+ * These are the same for every thread so are only written when the sieving
+ * primes are added (each numa node reads its own copy, see replica.h). The
+ * inverses of the primes are only read when the offsets are set up.
+ */
 struct prime_list
 {
-   struct prime_and_offset *primes;
+   uint8_t *a_byte_diffs;
+   double  *inverses;
    uint32_t start_a_byte;
    uint32_t cur_a_byte;
-   uint32_t ind_a_byte;
    uint32_t count;
+};
+
+
+/*
+ * Where each prime of a prime_list is up to in the thread's next block. The
+ * offsets are allocated by the thread itself so they are on its numa node.
+ */
+struct thread_list
+{
+   struct ind_and_offset *offsets;
+   uint32_t ind_a_byte;
    uint32_t index;
-   int64_t  last_blockno;
+};
+
+
+struct lu_calc_offs_thread_ctx
+{
+   struct thread_list lists[8];
+   int64_t last_blockno;
 };
 
 
@@ -39,7 +63,10 @@ struct lu_calc_offs_ctx
    uint32_t end_prime;
    uint32_t block_size;
    int nthreads;
-   struct prime_list **plist;
+   struct prime_list plist[8];
+   struct node_replica diffs_nodes[8];
+   size_t offsets_size;
+   struct lu_calc_offs_thread_ctx *thread_data;
 };
 
 
@@ -59,16 +86,18 @@ lu_calc_offs_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_pri
    sctx->block_size = pctx->current_block->block_size;
    sctx->nthreads = pctx->num_threads?:1;
 
-   sctx->plist = calloc((sizeof *sctx->plist), sctx->nthreads);
-   for (k = 0; k < sctx->nthreads; k++) {
-      sctx->plist[k] = calloc((sizeof *sctx->plist[k]), 8);
-      for (i = 0; i < 8; i++) {
-         sctx->plist[k][i].primes = malloc(sizeof(struct prime_and_offset) * (sctx->end_prime - start_prime) / 4 / 10 + 1000);
-         sctx->plist[k][i].start_a_byte = sctx->start_prime/30;
-         sctx->plist[k][i].cur_a_byte = sctx->start_prime/30;
-         sctx->plist[k][i].ind_a_byte = sctx->start_prime/30;
-      }
+   for (i = 0; i < 8; i++) {
+      sctx->plist[i].a_byte_diffs = malloc((sctx->end_prime - start_prime) / 4 / 10 + 1000);
+      sctx->plist[i].inverses = malloc(sizeof(double) * ((sctx->end_prime - start_prime) / 4 / 10 + 1000));
+      sctx->plist[i].start_a_byte = sctx->start_prime/30;
+      sctx->plist[i].cur_a_byte = sctx->start_prime/30;
    }
+
+   sctx->thread_data = calloc((sizeof *sctx->thread_data), sctx->nthreads);
+   sctx->offsets_size = sizeof(struct ind_and_offset) * (sctx->end_prime - start_prime) / 4 / 10 + 1000;
+   for (k = 0; k < sctx->nthreads; k++)
+      for (i = 0; i < 8; i++)
+         sctx->thread_data[k].lists[i].ind_a_byte = sctx->start_prime/30;
    return 0;
 }
 
@@ -79,13 +108,17 @@ lu_calc_offs_free(void *ctx)
    struct lu_calc_offs_ctx *sctx = ctx;
    int i;
    int k;
-   for (k = 0; k < sctx->nthreads; k++) {
+   for (k = 0; k < sctx->nthreads; k++)
       for (i = 0; i < 8; i++)
-         FREE(sctx->plist[k][i].primes);
-      FREE(sctx->plist[k]);
+         FREE(sctx->thread_data[k].lists[i].offsets);
+
+   for (i = 0; i < 8; i++) {
+      free_node_replica(&sctx->diffs_nodes[i]);
+      FREE(sctx->plist[i].a_byte_diffs);
+      FREE(sctx->plist[i].inverses);
    }
 
-   FREE(sctx->plist);
+   FREE(sctx->thread_data);
    FREE(ctx);
    return 0;
 }
@@ -103,94 +136,190 @@ lu_calc_offs_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t siz
       if (primelist[*ind] > sctx->end_prime)
          return 0;
 
-      int k;
-
-      for (k = 0; k < sctx->nthreads; k++) {
-         pl = &sctx->plist[k][pp_to_bit(primelist[*ind])];
-         pl->primes[pl->count].a_byte_diff = primelist[*ind]/30 - pl->cur_a_byte;
-         pl->primes[pl->count].offset = 0;
-         pl->cur_a_byte = primelist[*ind]/30;
-         pl->count++;
-      }
+      pl = &sctx->plist[pp_to_bit(primelist[*ind])];
+      pl->a_byte_diffs[pl->count] = primelist[*ind]/30 - pl->cur_a_byte;
+      pl->inverses[pl->count] = mod_inverse(primelist[*ind]);
+      pl->cur_a_byte = primelist[*ind]/30;
+      pl->count++;
    }
    return 0;
 }
 
 
-int
-lu_calc_offs_skip_to(struct prime_thread_ctx *__attribute__((unused))pctx, uint64_t __attribute__((unused))target_num, void *__attribute__((unused))ctx)
+static struct lu_calc_offs_thread_ctx *
+get_thread_data(struct lu_calc_offs_ctx *sctx, uint32_t thread_index)
 {
-   struct lu_calc_offs_ctx *sctx = ctx;
-   /* Recalculate all of the offsets depending on the new block */
+   struct lu_calc_offs_thread_ctx *tdata = &sctx->thread_data[thread_index];
    int i;
-   for (i = 0; i < 8; i++) {
-      sctx->plist[pctx->thread_index][i].index = 0;
-      sctx->plist[pctx->thread_index][i].ind_a_byte = sctx->start_prime / 30;
-      sctx->plist[pctx->thread_index][i].last_blockno = INT64_MAX;
-   }
-   return 0;
+
+   if (tdata->lists[0].offsets == NULL)
+      for (i = 0; i < 8; i++)
+         tdata->lists[i].offsets = malloc(sctx->offsets_size);
+   return tdata;
 }
 
 
+/*
+ * The primes now in the block are taken MOD_BATCH_SIZE at a time so their
+ * offsets can be worked out from a batch of remainders.
+ */
 static void
 check_new_sieve_primes_v2(struct lu_calc_offs_ctx *sctx, struct prime_current_block *pcb, int thread_id)
 {
-   uint32_t sieve_prime;
+   uint32_t primes[MOD_BATCH_SIZE];
+   uint32_t a_bytes[MOD_BATCH_SIZE];
+   uint32_t mods[MOD_BATCH_SIZE];
 
    uint64_t block_start_byte = pcb->block_start_byte;
    int i;
    int32_t offset;
    struct prime_list *pl;
-   struct prime_and_offset *po;
+   struct thread_list *tl;
+   struct ind_and_offset *po;
    const unsigned char *bytes;
    uint32_t a_byte;
+   uint32_t n;
+   uint32_t k;
+   int ind = 0;
+   for (i = 0; i < 8; i++) {
+      pl = &sctx->plist[i];
+      tl = &sctx->thread_data[thread_id].lists[i];
+      bytes = a_x_b_byte_diffs[i];
+
+      do {
+         a_byte = tl->ind_a_byte;
+         for (n = 0; n < MOD_BATCH_SIZE && tl->index + n < pl->count; n++) {
+            a_byte += pl->a_byte_diffs[tl->index + n];
+            primes[n] = a_byte * 30 + ind_to_mod[i];
+            if (primes[n] > pcb->sqrt_end_num)
+               break;
+            a_bytes[n] = a_byte;
+         }
+
+         mod_batch(block_start_byte, primes, &pl->inverses[tl->index], mods, n);
+
+         for (k = 0; k < n; k++) {
+            po = &tl->offsets[tl->index + k];
+            a_byte = a_bytes[k];
+
+            offset = 0 - mods[k];
+
+            if ((offset += a_byte) >= 0)
+               ind = 0;
+            else if ((offset += 6*a_byte + bytes[1]) >= 0)
+               ind = 1;
+            else if ((offset += 4*a_byte + bytes[2]) >= 0)
+               ind = 2;
+            else if ((offset += 2*a_byte + bytes[3]) >= 0)
+               ind = 3;
+            else if ((offset += 4*a_byte + bytes[4]) >= 0)
+               ind = 4;
+            else if ((offset += 2*a_byte + bytes[5]) >= 0)
+               ind = 5;
+            else if ((offset += 4*a_byte + bytes[6]) >= 0)
+               ind = 6;
+            else if ((offset += 6*a_byte + bytes[7]) >= 0)
+               ind = 7;
+            else if ((offset += 2*a_byte + 1) > 0)
+               ind = 0;
+
+            *po = (struct ind_and_offset){ind, offset};
+         }
+
+         if (n > 0) {
+            tl->index += n;
+            tl->ind_a_byte = a_bytes[n - 1];
+         }
+      } while (n == MOD_BATCH_SIZE);
+   }
+}
+
+
+/*
+ * Calculate the offsets directly for the block containing target_num. The
+ * offsets are relative to the start of the target block, which is what
+ * calc_primes expects when it follows on from the previous block.
+ */
+int
+lu_calc_offs_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
+{
+   struct lu_calc_offs_ctx *sctx = ctx;
+   struct lu_calc_offs_thread_ctx *tdata = get_thread_data(sctx, pctx->thread_index);
+   struct prime_current_block pcb = pctx->current_block;
+   int i;
+
+   pcb_set_block(&pcb, num_to_bytes(target_num) / pcb.block_size);
+
    for (i = 0; i < 8; i++) {
-      pl = &sctx->plist[thread_id][i];
-      a_byte = pl->ind_a_byte;
-      for ( ; pl->index < pl->count; pl->index++) {
-         po = &pl->primes[pl->index];
-         a_byte += po->a_byte_diff;
-         sieve_prime = (int32_t)a_byte * 30 + ind_to_mod[i];
-
-         if (sieve_prime > pcb->sqrt_end_num)
-            break;
-
-         bytes = a_x_b_byte_diffs[i];
-
-         offset = 0 - (block_start_byte % sieve_prime);
-
-         if ((offset += a_byte) >= 0)
-            po->ind = 0;
-         else if ((offset += 6*a_byte + bytes[1]) >= 0)
-            po->ind = 1;
-         else if ((offset += 4*a_byte + bytes[2]) >= 0)
-            po->ind = 2;
-         else if ((offset += 2*a_byte + bytes[3]) >= 0)
-            po->ind = 3;
-         else if ((offset += 4*a_byte + bytes[4]) >= 0)
-            po->ind = 4;
-         else if ((offset += 2*a_byte + bytes[5]) >= 0)
-            po->ind = 5;
-         else if ((offset += 4*a_byte + bytes[6]) >= 0)
-            po->ind = 6;
-         else if ((offset += 6*a_byte + bytes[7]) >= 0)
-            po->ind = 7;
-         else if ((offset += 2*a_byte + 1) > 0)
-            po->ind = 0;
-
-         po->offset = offset;
-         pl->ind_a_byte = a_byte;
+      tdata->lists[i].index = 0;
+      tdata->lists[i].ind_a_byte = sctx->start_prime / 30;
+   }
+   check_new_sieve_primes_v2(sctx, &pcb, pctx->thread_index);
+   tdata->last_blockno = pcb.block_num - 1;
+   return 0;
+}
+
+
+/* How many a_bytes each step from one multiple's bit to the next is */
+static const uint8_t a_x_mults[8] = {6, 4, 2, 4, 2, 4, 6, 2};
+
+
+/*
+ * Move the offsets on past 'blocks' blocks without marking them. A prime's
+ * multiples go round the same 8 steps every turn (the prime in bytes), so the
+ * whole turns are skipped with a division and the rest stepped through. For
+ * negative blocks the offset is taken back to the turn before the new block
+ * and stepped through in the same way.
+ */
+static void
+skip_blocks(struct lu_calc_offs_ctx *sctx, struct prime_thread_ctx *ptx, int64_t blocks)
+{
+   struct lu_calc_offs_thread_ctx *tdata = &sctx->thread_data[ptx->thread_index];
+   int64_t  bytes = blocks * ptx->current_block.block_size;
+   const unsigned char *diffs;
+   const uint8_t *a_byte_diff;
+   struct ind_and_offset *po;
+   uint32_t steps[8];
+   uint32_t turn;
+   uint32_t a_byte;
+   uint32_t i;
+   int64_t  off;
+   int      bit;
+   int      ind;
+   int      k;
+
+   for (bit = 0; bit < 8; bit++) {
+      diffs = a_x_b_byte_diffs[bit];
+      a_byte = sctx->plist[bit].start_a_byte;
+      a_byte_diff = get_node_replica(&sctx->diffs_nodes[bit], ptx, sctx->plist[bit].a_byte_diffs, sctx->plist[bit].count);
+      po = tdata->lists[bit].offsets;
+
+      for (i = 0; i < tdata->lists[bit].index; i++, po++) {
+         a_byte += a_byte_diff[i];
+
+         for (k = 0, turn = 0; k < 8; k++)
+            turn += steps[k] = a_x_mults[k] * a_byte + (k == 7 ? 1 : diffs[k + 1]);
+
+         off = (int64_t)po->offset - bytes;
+         if (bytes < 0)
+            off -= (off / turn + 1) * turn;
+         else if (off < 0)
+            off += -off / turn * turn;
+
+         for (ind = po->ind; off < 0; ind = (ind + 1) & 7)
+            off += steps[ind];
+
+         *po = (struct ind_and_offset){ind, off};
       }
    }
 }
 
 
 static inline int __attribute__((always_inline))
-check_set (struct prime_current_block *pcb, struct prime_and_offset *po, int32_t *off, int32_t a_byte_x_2, const unsigned char *bits, const unsigned char *bytes, const int ind, const int a_x)
+check_set (struct prime_current_block *pcb, struct ind_and_offset *po, int32_t *off, int32_t a_byte_x_2, const unsigned char *bits, const unsigned char *bytes, const int ind, const int a_x)
 {
       if (*off >= (int32_t)pcb->block_size) {
-         po->ind = ind;
-         po->offset = *off - pcb->block_size;
+         *po = (struct ind_and_offset){ind, *off - pcb->block_size};
          return 1;
       }
 
@@ -216,7 +345,7 @@ check_set (struct prime_current_block *pcb, struct prime_and_offset *po, int32_t
  * Unlike primes < 32*1024, these can't be done out of order to keep the same bit pattern
  */
 static inline void __attribute__((always_inline))
-compute_block(struct prime_current_block *pcb, struct prime_and_offset *po, int a_byte, int a_bit)
+compute_block(struct prime_current_block *pcb, struct ind_and_offset *po, int a_byte, int a_bit)
 {
    const unsigned char *bits = a_x_b_bitmask[a_bit];
    const unsigned char *bytes = a_x_b_byte_diffs[a_bit];
@@ -226,37 +355,35 @@ compute_block(struct prime_current_block *pcb, struct prime_and_offset *po, int
 
    off = po->offset;
 
+   /* Loops for larger blocks, where a prime can hit more than 16 times */
    switch (po->ind) {
-      case 0 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 0, 6) ) return;
-      case 1 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 1, 4) ) return;
-      case 2 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 2, 2) ) return;
-      case 3 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 3, 4) ) return;
-      case 4 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 4, 2) ) return;
-      case 5 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 5, 4) ) return;
-      case 6 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 6, 6) ) return;
-      case 7 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 7, 2) ) return;
-               if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 0, 6) ) return;
-               if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 1, 4) ) return;
-               if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 2, 2) ) return;
-               if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 3, 4) ) return;
-               if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 4, 2) ) return;
-               if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 5, 4) ) return;
-               if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 6, 6) ) return;
-               if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 7, 2) ) return;
+      for (;;) {
+         case 0 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 0, 6) ) return;
+         case 1 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 1, 4) ) return;
+         case 2 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 2, 2) ) return;
+         case 3 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 3, 4) ) return;
+         case 4 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 4, 2) ) return;
+         case 5 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 5, 4) ) return;
+         case 6 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 6, 6) ) return;
+         case 7 : if ( check_set(pcb, po, &off, a_byte_x_2, bits, bytes, 7, 2) ) return;
+      }
    }
 }
 
 
-static void
-do_for_bit(struct lu_calc_offs_ctx *sctx, struct prime_current_block *pcb, int bit, int thread_id)
+static void KERNEL_CLONES
+do_for_bit(struct lu_calc_offs_ctx *sctx, struct prime_thread_ctx *ptx, int bit)
 {
+   struct prime_current_block *pcb = &ptx->current_block;
+   struct prime_list *pl = &sctx->plist[bit];
    uint32_t i;
-   int32_t a_byte = sctx->plist[thread_id][bit].start_a_byte;
-   i = sctx->plist[thread_id][bit].index;
-   struct prime_and_offset *po = &sctx->plist[thread_id][bit].primes[0];
+   int32_t a_byte = pl->start_a_byte;
+   const uint8_t *a_byte_diff = get_node_replica(&sctx->diffs_nodes[bit], ptx, pl->a_byte_diffs, pl->count);
+   struct ind_and_offset *po = sctx->thread_data[ptx->thread_index].lists[bit].offsets;
+   i = sctx->thread_data[ptx->thread_index].lists[bit].index;
 
    while (i--) {
-      a_byte += po->a_byte_diff;
+      a_byte += *a_byte_diff++;
       compute_block(pcb, po, a_byte, bit);
       po++;
    }
@@ -267,30 +394,34 @@ int
 lu_calc_offs_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
 {
    struct lu_calc_offs_ctx *sctx = ctx;
-   int64_t skip = ptx->current_block.block_num - sctx->plist[ptx->thread_index][0].last_blockno;
+   struct lu_calc_offs_thread_ctx *tdata = get_thread_data(sctx, ptx->thread_index);
+   int64_t skip = ptx->current_block.block_num - tdata->last_blockno;
    int i;
 
-   sctx->plist[ptx->thread_index][0].last_blockno = ptx->current_block.block_num;
+   tdata->last_blockno = ptx->current_block.block_num;
 
-   /* TODO: currently cannat handle skip rate > 1 */
-   if (skip < 0 || skip > 1) {
+   /* As in calc_offs, going back keeps the offsets once past the primes */
+   if (skip < 0 && ptx->current_block.block_start_num <= sctx->end_prime) {
       for (i = 0; i < 8; i++) {
-         sctx->plist[ptx->thread_index][i].index = 0;
-         sctx->plist[ptx->thread_index][i].ind_a_byte = sctx->start_prime / 30;
+         tdata->lists[i].index = 0;
+         tdata->lists[i].ind_a_byte = sctx->start_prime / 30;
       }
    }
+   else if (skip < 0 || skip > 1) {
+      skip_blocks(sctx, ptx, skip - 1);
+   }
 
    /* Mark off multiples of 'a' in the block */
    check_new_sieve_primes_v2(sctx, &ptx->current_block, ptx->thread_index);
 
-   do_for_bit(sctx, &ptx->current_block, 0, ptx->thread_index);
-   do_for_bit(sctx, &ptx->current_block, 1, ptx->thread_index);
-   do_for_bit(sctx, &ptx->current_block, 2, ptx->thread_index);
-   do_for_bit(sctx, &ptx->current_block, 3, ptx->thread_index);
-   do_for_bit(sctx, &ptx->current_block, 4, ptx->thread_index);
-   do_for_bit(sctx, &ptx->current_block, 5, ptx->thread_index);
-   do_for_bit(sctx, &ptx->current_block, 6, ptx->thread_index);
-   do_for_bit(sctx, &ptx->current_block, 7, ptx->thread_index);
+   do_for_bit(sctx, ptx, 0);
+   do_for_bit(sctx, ptx, 1);
+   do_for_bit(sctx, ptx, 2);
+   do_for_bit(sctx, ptx, 3);
+   do_for_bit(sctx, ptx, 4);
+   do_for_bit(sctx, ptx, 5);
+   do_for_bit(sctx, ptx, 6);
+   do_for_bit(sctx, ptx, 7);
 
    return 0;
 }
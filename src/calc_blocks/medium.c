@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "misc.h"
+#include "wheel.h"
+#include "ctx.h"
+#include "fastmod.h"
+
+/*
+ * Sieve for the medium sized primes, ie primes > 2^15 up to a few times the
+ * numbers in a block.
+ *
+ * These primes only hit a block a handful of times (or not at all), so the
+ * cost is mostly in moving between primes rather than in the marking. The
+ * main costs are the branches to pick the starting position in the unrolled
+ * loop (as in lu_calc_offs) and the branch to exit the loop.
+ *
+ * Instead of keeping the primes in a fixed order, each prime is kept in a list
+ * according to its a_bit and the b_bit of its next multiple. Every prime in a
+ * list starts the unrolled loop at the same position so this branch is always
+ * predicted, and the a_bit is a constant for the marking. Once a prime leaves
+ * the block it is moved to the list for the b_bit it will start the next block
+ * at.
+ *
+ * A thread that jumps ahead to a new block takes the skipped bytes (mod the
+ * prime, from mod_batch()) off each prime's offset and steps it on to its
+ * first multiple in the new block, as skip_blocks does in lu_calc_offs. Each
+ * prime keeps its index in the prime list for this. Going backwards is the
+ * same with the bytes put back on, so only a thread that goes back to below
+ * the primes starts again from the prime list.
+ */
+
+
+struct medium_prime
+{
+   uint16_t a_byte;
+   uint16_t index;
+   uint32_t offset;
+};
+
+
+struct medium_list
+{
+   struct medium_prime *primes;
+   uint32_t             count;
+   uint32_t             size;
+};
+
+
+/*
+ * lists[cur] are the lists for the block being calculated and lists[!cur] the
+ * lists for the next block. Each is indexed by a_bit * 8 + b_bit.
+ */
+struct medium_thread_ctx
+{
+   struct medium_list lists[2][64];
+   int                cur;
+   uint32_t           calculated_index;
+   int64_t            last_blockno;
+   uint32_t          *skip_mods;
+};
+
+
+struct medium_ctx
+{
+   uint32_t  start_prime;
+   uint32_t  end_prime;
+   uint32_t  block_size;
+   int       nthreads;
+   uint32_t *primelist;
+   double   *inverses;
+   uint32_t  primelist_count;
+   uint32_t  primelist_size;
+   struct medium_thread_ctx *thread_data;
+};
+
+
+int
+medium_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_prime, void **ctx)
+{
+   struct medium_ctx *sctx = calloc(1, sizeof (struct medium_ctx));
+   int i;
+   *ctx = sctx;
+
+   sctx->start_prime = start_prime;
+   sctx->end_prime = MIN(pctx->run_info.max_sieve_prime, end_prime);
+   sctx->block_size = pctx->current_block->block_size;
+
+   /* The first multiples are found with mod_batch() */
+   assert(sctx->end_prime < MOD_BATCH_MAX_DIV);
+
+   sctx->primelist_size = 1024;
+   sctx->primelist = malloc(sizeof(uint32_t) * sctx->primelist_size);
+   sctx->inverses = malloc(sizeof(double) * sctx->primelist_size);
+
+   sctx->nthreads = pctx->num_threads ?: 1;
+   sctx->thread_data = calloc(sctx->nthreads, sizeof(struct medium_thread_ctx));
+
+   for (i = 0; i < sctx->nthreads; i++)
+      sctx->thread_data[i].last_blockno = INT64_MAX;
+   return 0;
+}
+
+
+int
+medium_free(void *ctx)
+{
+   struct medium_ctx *sctx = ctx;
+   int i;
+   int k;
+
+   for (i = 0; i < sctx->nthreads; i++) {
+      for (k = 0; k < 64; k++) {
+         FREE(sctx->thread_data[i].lists[0][k].primes);
+         FREE(sctx->thread_data[i].lists[1][k].primes);
+      }
+      FREE(sctx->thread_data[i].skip_mods);
+   }
+   FREE(sctx->thread_data);
+   FREE(sctx->primelist);
+   FREE(sctx->inverses);
+   FREE(ctx);
+   return 0;
+}
+
+
+int
+medium_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t size, void *ctx)
+{
+   struct medium_ctx *sctx = ctx;
+   for (; *ind < size; (*ind)++) {
+      if (primelist[*ind] < sctx->start_prime)
+         continue;
+      if (primelist[*ind] > sctx->end_prime)
+         return 0;
+
+      /* The index and a_byte of each prime are kept in 16 bits */
+      assert(sctx->primelist_count <= UINT16_MAX);
+
+      if (sctx->primelist_count == sctx->primelist_size) {
+         sctx->primelist_size *= 2;
+         sctx->primelist = realloc(sctx->primelist, sizeof(uint32_t) * sctx->primelist_size);
+         sctx->inverses = realloc(sctx->inverses, sizeof(double) * sctx->primelist_size);
+      }
+      sctx->inverses[sctx->primelist_count] = mod_inverse(primelist[*ind]);
+      sctx->primelist[sctx->primelist_count++] = primelist[*ind];
+   }
+   return 0;
+}
+
+
+static inline void __attribute__((always_inline))
+push_prime(struct medium_list *ml, uint32_t a_byte, uint32_t index, uint32_t offset)
+{
+   if (ml->count == ml->size) {
+      ml->size = ml->size ? ml->size * 2 : 256;
+      ml->primes = realloc(ml->primes, sizeof(struct medium_prime) * ml->size);
+   }
+   ml->primes[ml->count].a_byte = a_byte;
+   ml->primes[ml->count].index = index;
+   ml->primes[ml->count].offset = offset;
+   ml->count++;
+}
+
+
+static void
+reset_lists(struct medium_thread_ctx *tdata)
+{
+   int k;
+
+   for (k = 0; k < 64; k++) {
+      tdata->lists[0][k].count = 0;
+      tdata->lists[1][k].count = 0;
+   }
+   tdata->calculated_index = 0;
+}
+
+
+/*
+ * Add the primes which are now <= sqrt(block_end) to the lists of the block.
+ * The first multiple is max(prime * prime, block_start).
+ *
+ * Below the block the multiples are found from block_start_byte % prime (a
+ * batch at a time, see fastmod.h). The byte that takes off is that of
+ * prime * 30k, so the multiples by the wheel numbers after 30k are stepped
+ * through, as in lu_calc_offs, to the first one in the block.
+ */
+static void
+check_new_sieve_primes(struct medium_ctx *sctx, struct medium_thread_ctx *tdata, struct prime_current_block *pcb)
+{
+   const unsigned char *bytes;
+   uint32_t mods[MOD_BATCH_SIZE];
+   uint32_t sieve_prime;
+   uint32_t b_bit;
+   uint32_t a_byte;
+   uint32_t a_bit;
+   int32_t  offset;
+   uint32_t n;
+   uint32_t k;
+
+   do {
+      for (n = 0; n < MOD_BATCH_SIZE && tdata->calculated_index + n < sctx->primelist_count; n++)
+         if (sctx->primelist[tdata->calculated_index + n] > pcb->sqrt_end_num)
+            break;
+
+      mod_batch(pcb->block_start_byte, &sctx->primelist[tdata->calculated_index], &sctx->inverses[tdata->calculated_index], mods, n);
+
+      for (k = 0; k < n; k++) {
+         sieve_prime = sctx->primelist[tdata->calculated_index + k];
+
+         a_byte = num_to_bytes(sieve_prime);
+         a_bit  = pp_to_bit(sieve_prime);
+
+         if ((uint64_t)sieve_prime * sieve_prime >= pcb->block_start_num) {
+            /* a * a = a * a_byte * 30 + a_byte * a_bit_val + a_bit_val * a_bit_val */
+            b_bit = a_bit;
+            offset = (uint64_t)sieve_prime * a_byte + (uint64_t)a_byte * ind_to_mod[a_bit]
+                     + a_x_b_bytes[a_bit][a_bit] - pcb->block_start_byte;
+         }
+         else {
+            bytes = a_x_b_byte_diffs[a_bit];
+            offset = (int32_t)a_byte - (int32_t)mods[k];
+            for (b_bit = 0; offset < 0; b_bit = (b_bit + 1) & 7)
+               offset += pp_diffs[b_bit] * a_byte + (b_bit == 7 ? 1 : bytes[b_bit + 1]);
+         }
+
+         push_prime(&tdata->lists[tdata->cur][a_bit * 8 + b_bit], a_byte, tdata->calculated_index + k, offset);
+      }
+      tdata->calculated_index += n;
+   } while (n == MOD_BATCH_SIZE);
+}
+
+
+/*
+ * Move the primes on past the blocks skipped since the last one. lists[cur]
+ * hold the offsets from the block after the last one, so skip - 1 blocks of
+ * bytes come off each. A turn of the wheel (8 steps) is the prime in bytes,
+ * so the offset is taken back to the turn before the new block and then
+ * stepped through to the first multiple in it. lists[!cur] are empty between
+ * blocks, so the primes are moved into them.
+ *
+ * Going back (skip < 1) puts the bytes back on, which is the same as taking
+ * off the prime less them.
+ */
+static void
+skip_blocks(struct medium_ctx *sctx, struct medium_thread_ctx *tdata, int64_t skip)
+{
+   struct medium_list  *lists = tdata->lists[tdata->cur];
+   struct medium_list  *next  = tdata->lists[!tdata->cur];
+   struct medium_prime *mp;
+   const unsigned char *bytes;
+   uint32_t sieve_prime;
+   uint32_t a_byte;
+   int32_t  offset;
+   int      a_bit;
+   int      b_bit;
+   uint32_t i;
+   int      k;
+
+   if (tdata->skip_mods == NULL)
+      tdata->skip_mods = malloc(sizeof(uint32_t) * (UINT16_MAX + 1));
+
+   mod_batch((skip < 1 ? 1 - skip : skip - 1) * sctx->block_size, sctx->primelist, sctx->inverses, tdata->skip_mods, tdata->calculated_index);
+   if (skip < 1)
+      for (i = 0; i < tdata->calculated_index; i++)
+         tdata->skip_mods[i] = sctx->primelist[i] - tdata->skip_mods[i];
+
+   for (k = 0; k < 64; k++) {
+      a_bit = k / 8;
+      bytes = a_x_b_byte_diffs[a_bit];
+
+      for (mp = lists[k].primes; mp < lists[k].primes + lists[k].count; mp++) {
+         a_byte = mp->a_byte;
+         sieve_prime = sctx->primelist[mp->index];
+
+         /* A prime added in the last block can still be more than a turn ahead */
+         for (offset = (int32_t)mp->offset - (int32_t)tdata->skip_mods[mp->index]; offset >= 0; )
+            offset -= sieve_prime;
+
+         for (b_bit = k % 8; offset < 0; b_bit = (b_bit + 1) & 7)
+            offset += pp_diffs[b_bit] * a_byte + (b_bit == 7 ? 1 : bytes[b_bit + 1]);
+
+         push_prime(&next[a_bit * 8 + b_bit], a_byte, mp->index, offset);
+      }
+      lists[k].count = 0;
+   }
+   tdata->cur = !tdata->cur;
+}
+
+
+/*
+ * Calculate the offsets directly for the block containing target_num, as if
+ * the previous block had just been calculated.
+ */
+int
+medium_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
+{
+   struct medium_ctx          *sctx = ctx;
+   struct medium_thread_ctx   *tdata = &sctx->thread_data[pctx->thread_index];
+   struct prime_current_block  pcb = pctx->current_block;
+
+   pcb_set_block(&pcb, num_to_bytes(target_num) / pcb.block_size);
+
+   reset_lists(tdata);
+   check_new_sieve_primes(sctx, tdata, &pcb);
+   tdata->last_blockno = pcb.block_num - 1;
+   return 0;
+}
+
+
+static inline int __attribute__((always_inline))
+check_set(char *block, uint32_t block_size, uint32_t *off, uint32_t a_byte, const unsigned char *bits, const unsigned char *bytes, const int ind, const int a_x)
+{
+   if (*off >= block_size)
+      return 1;
+
+   block[*off] |= bits[ind];
+   *off += a_byte * a_x + (ind == 7 ? 1 : bytes[ind + 1]);
+   return 0;
+}
+
+
+/*
+ * The b_bit only changes between lists so the switch is well predicted. When
+ * the prime leaves the block 'ind' is the b_bit of the next multiple.
+ */
+static inline void __attribute__((always_inline))
+sieve_list(char *block, uint32_t block_size, struct medium_list *ml, struct medium_list *next, const int a_bit, int b_bit)
+{
+   const unsigned char *bits = a_x_b_bitmask[a_bit];
+   const unsigned char *bytes = a_x_b_byte_diffs[a_bit];
+   struct medium_prime *mp;
+   uint32_t a_byte;
+   uint32_t off;
+   int ind;
+
+   for (mp = ml->primes; mp < ml->primes + ml->count; mp++) {
+      a_byte = mp->a_byte;
+      off = mp->offset;
+
+      switch (b_bit) {
+         for (;;) {
+            case 0 : if ( check_set(block, block_size, &off, a_byte, bits, bytes, 0, 6) ) { ind = 0; break; } FALLTHROUGH;
+            case 1 : if ( check_set(block, block_size, &off, a_byte, bits, bytes, 1, 4) ) { ind = 1; break; } FALLTHROUGH;
+            case 2 : if ( check_set(block, block_size, &off, a_byte, bits, bytes, 2, 2) ) { ind = 2; break; } FALLTHROUGH;
+            case 3 : if ( check_set(block, block_size, &off, a_byte, bits, bytes, 3, 4) ) { ind = 3; break; } FALLTHROUGH;
+            case 4 : if ( check_set(block, block_size, &off, a_byte, bits, bytes, 4, 2) ) { ind = 4; break; } FALLTHROUGH;
+            case 5 : if ( check_set(block, block_size, &off, a_byte, bits, bytes, 5, 4) ) { ind = 5; break; } FALLTHROUGH;
+            case 6 : if ( check_set(block, block_size, &off, a_byte, bits, bytes, 6, 6) ) { ind = 6; break; } FALLTHROUGH;
+            case 7 : if ( check_set(block, block_size, &off, a_byte, bits, bytes, 7, 2) ) { ind = 7; break; }
+         }
+      }
+
+      push_prime(&next[ind], a_byte, mp->index, off - block_size);
+   }
+   ml->count = 0;
+}
+
+
+/*
+ * The a_bit is made a constant so the bitmasks don't need to be looked up
+ */
+static inline void __attribute__((always_inline))
+sieve_a_bit(char *block, uint32_t block_size, struct medium_list *lists, struct medium_list *next, const int a_bit)
+{
+   int b_bit;
+
+   for (b_bit = 0; b_bit < 8; b_bit++)
+      sieve_list(block, block_size, &lists[a_bit * 8 + b_bit], &next[a_bit * 8], a_bit, b_bit);
+}
+
+
+int
+medium_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
+{
+   struct medium_ctx        *sctx = ctx;
+   struct medium_thread_ctx *tdata = &sctx->thread_data[ptx->thread_index];
+   struct medium_list       *lists;
+   struct medium_list       *next;
+   int64_t skip = ptx->current_block.block_num - tdata->last_blockno;
+   int     restart = tdata->last_blockno == INT64_MAX || ptx->current_block.block_start_num <= sctx->end_prime;
+
+   tdata->last_blockno = ptx->current_block.block_num;
+
+   if (sctx->primelist_count == 0)
+      return 0;
+
+   /*
+    * Going back (eg a stolen run behind this one) keeps the lists unless it is
+    * the thread's first block or the block has the primes themselves in it,
+    * which would be marked off. Primes past the new sqrt(block_end) only mark
+    * off composites.
+    */
+   if (skip < 1 && restart)
+      reset_lists(tdata);
+   else if (skip != 1)
+      skip_blocks(sctx, tdata, skip);
+
+   check_new_sieve_primes(sctx, tdata, &ptx->current_block);
+
+   lists = tdata->lists[tdata->cur];
+   next  = tdata->lists[!tdata->cur];
+
+   sieve_a_bit(ptx->current_block.block, sctx->block_size, lists, next, 0);
+   sieve_a_bit(ptx->current_block.block, sctx->block_size, lists, next, 1);
+   sieve_a_bit(ptx->current_block.block, sctx->block_size, lists, next, 2);
+   sieve_a_bit(ptx->current_block.block, sctx->block_size, lists, next, 3);
+   sieve_a_bit(ptx->current_block.block, sctx->block_size, lists, next, 4);
+   sieve_a_bit(ptx->current_block.block, sctx->block_size, lists, next, 5);
+   sieve_a_bit(ptx->current_block.block, sctx->block_size, lists, next, 6);
+   sieve_a_bit(ptx->current_block.block, sctx->block_size, lists, next, 7);
+
+   tdata->cur = !tdata->cur;
+
+   return 0;
+}
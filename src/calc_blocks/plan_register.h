@@ -9,6 +9,18 @@
  */
 
 
+/*
+ * Each entry gives these. skip_to is called once the sieving primes are found,
+ * on the first thread, to get the entry's state ready for the block containing
+ * target_num (the start of the range). Entries that keep nothing between
+ * blocks, working each block's offsets out from its start, have nothing to do
+ * there.
+ *
+ * calc_primes works out from the thread's last block how far it has jumped
+ * (striped, stolen or node range runs). calc_offs, read_offs, lu_calc_offs and
+ * medium move their offsets by the jump either way and only start again when
+ * sent back to a block holding their primes. bucket only moves forwards.
+ */
 #define DECLARE_PLAN_ENTRY_FUNCTIONS(name) \
    int name##_init(struct prime_ctx *pctx, uint32_t start_sieve_prime, uint32_t end_sieve_prime, void **ctx); \
    int name##_free(void *ctx); \
@@ -99,7 +111,7 @@ DECLARE_PLAN_ENTRY_FUNCTIONS(simple);
 /**
  * simple_middle - Small advancement on the general 'simple' plan
  *
- * This only works for primes that are < block_size, and to a maximum of 2^16.
+ * This only works for primes to a maximum of 2^16.
  *
  * The main optimisations from the 'simple' plan are:
  *  - calculates all 8 'b_bits' for a given prime at the same time
@@ -128,10 +140,27 @@ DECLARE_PLAN_ENTRY_FUNCTIONS(simple_middle);
 
 DECLARE_PLAN_ENTRY_FUNCTIONS(load_unaligned);
 
+/**
+ * lower_middle - The abit trick for the primes from 96 to 256
+ *
+ * Each of the 8 bits of the block is taken as a bit plane, with a ymm
+ * register per plane for 256 bytes of the block. A prime sets every prime'th
+ * bit of a plane, which is an unaligned load from a pattern of the prime's
+ * bytes (plus 32). All the primes are ORed into the registers, which are then
+ * transposed back into bytes and written to the block once.
+ *
+ * Nothing is kept between blocks. With load_unaligned to 96 it takes about a
+ * quarter less time from 64 to 256 than calc_offs, "breakdown - calc_offs" is
+ * "breakdown - best" with calc_offs for those to compare them.
+ */
+
+DECLARE_PLAN_ENTRY_FUNCTIONS(lower_middle);
+
 /**
  * read_offs - Optimisation on the simple_middle plan
  *
- * This only works for primes that are < block_size, and to a maximum of 2^15.
+ * This only works for primes to a maximum of 2^15. Primes larger than the
+ * block overrun it into the guard area.
  *
  * The main optimisations from the 'simple_middle' plan are:
  *   - Offsets are calculated initially but are used read_only. A separate
@@ -153,7 +182,8 @@ DECLARE_PLAN_ENTRY_FUNCTIONS(read_offs);
 /**
  * calc_offs - Calculate the offsets
  *
- * This only works for primes that are < block_size, and to a maximum of 2^15.
+ * This only works for primes to a maximum of 2^15. Primes larger than the
+ * block overrun it into the guard areas.
  *
  * It calculates the 8 relative offsets for 16 primes at a time in ymm
  * registers.
@@ -168,12 +198,45 @@ DECLARE_PLAN_ENTRY_FUNCTIONS(calc_offs);
  * lu_calc_offs - Calculate the offsets
  *
  * This only works for primes that are > 2^15. It is not optimal
- * once no bits are set in any one 32*1024 block.
+ * once no bits are set in any one block.
  */
 
 DECLARE_PLAN_ENTRY_FUNCTIONS(lu_calc_offs);
 
 
+/**
+ * medium - Sieve for primes > 2^15 that hit a block only a few times
+ *
+ * Each prime keeps the byte offset of its next multiple. The primes are kept
+ * in lists by a_bit and the b_bit of that multiple so all the primes in a list
+ * enter the unrolled marking loop at the same place.
+ *
+ * NOTE: each thread keeps its own lists (8 bytes per prime). A thread that
+ * jumps to another block, ahead or back, moves each of its primes there.
+ */
+
+DECLARE_PLAN_ENTRY_FUNCTIONS(medium);
+
+
+/**
+ * bucket - Bucket sieve for the large primes
+ *
+ * This is intended for primes that are larger than the numbers in a block
+ * (ie > 30 * block_size) so that most primes don't hit most blocks.
+ *
+ * Each prime is kept in a per-thread bucket for the next block that it hits.
+ * Only the primes in the bucket of the current block are touched, which are
+ * then moved to the bucket of the next block they hit.
+ *
+ * NOTE: the prime list is shared, but each thread keeps its own buckets (8
+ * bytes per prime in use). A thread that skips ahead moves each of its primes
+ * straight past the skipped blocks, only going back to the prime list if it
+ * is sent backwards.
+ */
+
+DECLARE_PLAN_ENTRY_FUNCTIONS(bucket);
+
+
 /**
  * keep_byte - instead of all offsets, keep some information and calculate 'b'
  *
@@ -188,8 +251,8 @@ const struct prime_plan plans[] = {
       "calc middle primes", 32*1024, 4,
          {{"unaligned",     1,          0,          96,  USE_PLAN_ENTRY_FUNCTIONS(load_unaligned)},
           {"calc_offs",     1,         96,     (1<<15),  USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
-          {"lu_calc_offs",  1,    (1<<15),      400000,  USE_PLAN_ENTRY_FUNCTIONS(lu_calc_offs)},
-          {"simple_sieve",  1,     400000,  UINT32_MAX,  USE_PLAN_ENTRY_FUNCTIONS(simple)}}
+          {"medium",        8,    (1<<15),      400000,  USE_PLAN_ENTRY_FUNCTIONS(medium)},
+          {"bucket",        8,     400000,  UINT32_MAX,  USE_PLAN_ENTRY_FUNCTIONS(bucket)}}
    },
    {
       "calc lower upper primes", 32*1024, 4,
@@ -221,8 +284,8 @@ const struct prime_plan plans[] = {
          {{ "to   16", 1,       0,  (1<<4), USE_PLAN_ENTRY_FUNCTIONS(load_unaligned)},
           { "to   32", 1,  (1<<4),  (1<<5), USE_PLAN_ENTRY_FUNCTIONS(load_unaligned)},
           { "to   64", 1,  (1<<5),  (1<<6), USE_PLAN_ENTRY_FUNCTIONS(load_unaligned)},
-          { "to  128", 1,  (1<<6),  (1<<7), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
-          { "to  256", 1,  (1<<7),  (1<<8), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to   96", 1,  (1<<6),      96, USE_PLAN_ENTRY_FUNCTIONS(load_unaligned)},
+          { "to  256", 1,      96,  (1<<8), USE_PLAN_ENTRY_FUNCTIONS(lower_middle)},
           { "to  512", 1,  (1<<8),  (1<<9), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
           { "to 1024", 1,  (1<<9), (1<<10), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
           { "to 2048", 1, (1<<10), (1<<11), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
@@ -257,6 +320,23 @@ const struct prime_plan plans[] = {
    {
       "slow", 32*1024, 1,
          {{ "slow_sieve", 1, 0, UINT32_MAX, USE_PLAN_ENTRY_FUNCTIONS(slow)}}
+   },
+   {
+      "breakdown - calc_offs", 32*1024, 14,
+         {{ "to   16", 1,       0,  (1<<4), USE_PLAN_ENTRY_FUNCTIONS(load_unaligned)},
+          { "to   32", 1,  (1<<4),  (1<<5), USE_PLAN_ENTRY_FUNCTIONS(load_unaligned)},
+          { "to   64", 1,  (1<<5),  (1<<6), USE_PLAN_ENTRY_FUNCTIONS(load_unaligned)},
+          { "to  128", 1,  (1<<6),  (1<<7), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to  256", 1,  (1<<7),  (1<<8), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to  512", 1,  (1<<8),  (1<<9), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to 1024", 1,  (1<<9), (1<<10), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to 2048", 1, (1<<10), (1<<11), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to 4096", 1, (1<<11), (1<<12), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to   8k", 1, (1<<12), (1<<13), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to  16k", 1, (1<<13), (1<<14), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to  32k", 1, (1<<14), (1<<15), USE_PLAN_ENTRY_FUNCTIONS(calc_offs)},
+          { "to  64k", 1, (1<<15), (1<<16), USE_PLAN_ENTRY_FUNCTIONS(lu_calc_offs)},
+          { "rest",    1, (1<<16), UINT32_MAX, USE_PLAN_ENTRY_FUNCTIONS(simple)}}
    }
 };
 #endif
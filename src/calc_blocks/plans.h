@@ -23,10 +23,15 @@ struct prime_current_block;
 
 /*
  * The function calc_primes will be called with the start/end numbers
+ *
+ * With a block_multiplier of N the entry is called with N consecutive blocks
+ * at a time (ie a super-segment sized for the L2 cache), which saves the per
+ * block work for the larger primes. Consecutive entries with the same
+ * multiplier are run together on each block.
  */
 struct prime_plan_entry {
    const char *name;
-   const uint32_t block_multiplier; /* currently unused */
+   const uint32_t block_multiplier; /* power of 2, calc_primes is called with block_size * block_multiplier */
    const uint32_t start;
    const uint32_t end;
    int (*init)(struct prime_ctx *pctx, uint32_t start_sieve_prime, uint32_t end_sieve_prime, void **ctx);
@@ -6,19 +6,19 @@
 #include "misc.h"
 #include "wheel.h"
 #include "ctx.h"
+#include "replica.h"
+#include "fastmod.h"
 
-struct prime_and_offset
-{
-   uint16_t prime;
-   uint16_t offset;
-}__attribute__((__packed__));
-
-
+/*
+ * The primes and the byte offset of each bit within a prime are shared by the
+ * threads and only written when the sieving primes are added (each numa node
+ * reads its own copy, see replica.h), as are the inverses of the primes for
+ * mod_batch(). Each thread only keeps the offset of each prime into its next
+ * block, allocated by the thread itself so it is on the thread's node.
+ */
 struct read_offs_thread_ctx
 {
-   struct prime_and_offset *primelist;
-   uint16_t *offsets;
-   uint32_t primelist_count;
+   uint16_t *next_offsets;
    uint32_t calculated_index;
    uint32_t top10_index[10];
    uint32_t top10_count[10];
@@ -30,6 +30,13 @@ struct read_offs_ctx
    uint32_t start_prime;
    uint32_t end_prime;
    int nthreads;
+   uint16_t *primelist;
+   uint16_t *offsets;
+   double   *inverses;
+   uint32_t primelist_count;
+   struct node_replica primelist_nodes;
+   struct node_replica offsets_nodes;
+   size_t next_offsets_size;
    struct read_offs_thread_ctx *thread_data;
 };
 
@@ -46,14 +53,17 @@ read_offs_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_prime,
 
    sctx->nthreads = pctx->num_threads ?: 1;
 
-   assert(sctx->end_prime <= pctx->current_block->block_size);
+   /* Primes larger than the block can overrun it by up to a prime (into the 32K guard area) */
+   assert(sctx->end_prime <= pctx->current_block->block_size || sctx->end_prime <= 32*1024);
    assert(sctx->end_prime <= UINT16_MAX);
 
+   sctx->primelist = malloc(sizeof(uint16_t) * (sctx->end_prime - start_prime) / 4 + 1000);
+   sctx->offsets = malloc(sizeof(uint16_t) * 8 * (sctx->end_prime - start_prime) / 4 + 1000);
+   sctx->inverses = malloc(sizeof(double) * ((sctx->end_prime - start_prime) / 4 + 1000));
    sctx->thread_data = calloc(sizeof(struct read_offs_thread_ctx), sctx->nthreads);
+   sctx->next_offsets_size = sizeof(uint16_t) * (sctx->end_prime - start_prime) / 4 + 1000;
 
    for (i = 0; i < sctx->nthreads; i++) {
-      sctx->thread_data[i].primelist = malloc(sizeof(struct prime_and_offset) * (sctx->end_prime - start_prime) / 4 + 1000);
-      sctx->thread_data[i].offsets = malloc(sizeof(uint16_t ) * 8 * (sctx->end_prime - start_prime) / 4 + 1000);
       sctx->thread_data[i].last_blockno = INT64_MAX;
       sctx->thread_data[i].calculated_index = 0;
    }
@@ -66,11 +76,14 @@ read_offs_free(void *ctx)
 {
    int i;
    struct read_offs_ctx *sctx = ctx;
-   for (i = 0; i < sctx->nthreads; i++) {
-      FREE(sctx->thread_data[i].primelist);
-      FREE(sctx->thread_data[i].offsets);
-   }
+   for (i = 0; i < sctx->nthreads; i++)
+      FREE(sctx->thread_data[i].next_offsets);
    FREE(sctx->thread_data);
+   free_node_replica(&sctx->offsets_nodes);
+   free_node_replica(&sctx->primelist_nodes);
+   FREE(sctx->offsets);
+   FREE(sctx->inverses);
+   FREE(sctx->primelist);
    FREE(ctx);
    return 0;
 }
@@ -80,7 +93,8 @@ int
 read_offs_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t size, void *ctx)
 {
    struct read_offs_ctx *sctx = ctx;
-   struct read_offs_thread_ctx *tdata;
+   uint32_t sieve_prime;
+   uint16_t *offsets;
    int i;
    for (; *ind < size; (*ind)++) {
       if (primelist[*ind] < sctx->start_prime)
@@ -88,29 +102,15 @@ read_offs_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t size,
       if (primelist[*ind] > sctx->end_prime)
          return 0;
 
-      for (i = 0; i < sctx->nthreads; i++) {
-         tdata = &sctx->thread_data[i];
-         tdata->primelist[tdata->primelist_count].prime = primelist[*ind];
-         tdata->primelist[tdata->primelist_count].offset = primelist[*ind];
-         tdata->primelist_count++;
-      }
-   }
-   return 0;
-}
+      sieve_prime = primelist[*ind];
+      offsets = &sctx->offsets[sctx->primelist_count * 8];
 
+      for (i = 0; i < 8; i++)
+         offsets[num_to_bit(ind_to_mod[i] * sieve_prime)] = num_to_bytes(ind_to_mod[i] * sieve_prime);
 
-int
-read_offs_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
-{
-   (void)target_num;
-
-   struct read_offs_ctx *sctx = ctx;
-
-   /* Recalculate all of the offsets depending on the new block */
-   sctx->thread_data[pctx->thread_index].calculated_index = 0;
-   sctx->thread_data[pctx->thread_index].last_blockno = INT64_MAX;
-   bzero(sctx->thread_data[pctx->thread_index].top10_count, sizeof sctx->thread_data[pctx->thread_index].top10_count);
-
+      sctx->inverses[sctx->primelist_count] = mod_inverse(sieve_prime);
+      sctx->primelist[sctx->primelist_count++] = sieve_prime;
+   }
    return 0;
 }
 
@@ -120,7 +120,7 @@ read_offs_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
  * block (ie don't really know 'n').
  */
 static void
-compute_block_first_time(struct prime_current_block *pcb, uint32_t sieve_prime, uint16_t *offsets)
+compute_block_first_time(struct prime_current_block *pcb, uint32_t sieve_prime, const uint16_t *offsets)
 {
    char *bmp;
    int   i;
@@ -134,23 +134,41 @@ compute_block_first_time(struct prime_current_block *pcb, uint32_t sieve_prime,
 }
 
 
+/*
+ * Fills the batch with the primes from index and their remainders for mode 0
+ */
+static uint32_t
+get_mod_batch(struct read_offs_ctx *sctx, uint32_t index, uint64_t start_byte, uint64_t skip_bytes, uint32_t *start_mods, uint32_t *skip_mods)
+{
+   uint32_t primes[MOD_BATCH_SIZE];
+   uint32_t n;
+
+   for (n = 0; n < MOD_BATCH_SIZE && index + n < sctx->primelist_count; n++)
+      primes[n] = sctx->primelist[index + n];
+
+   mod_batch(start_byte, primes, &sctx->inverses[index], start_mods, n);
+   mod_batch(skip_bytes, primes, &sctx->inverses[index], skip_mods, n);
+   return n;
+}
+
+
 static void
-check_new_sieve_primes(struct read_offs_thread_ctx *tdata, struct prime_current_block *pcb, int skip, int mode)
+check_new_sieve_primes(struct read_offs_ctx *sctx, struct read_offs_thread_ctx *tdata, struct prime_current_block *pcb, int skip, int mode)
 {
-   struct prime_and_offset *po;
    uint32_t sieve_prime;
-   uint16_t *offsets;
+   uint16_t *next_offset;
+   uint32_t start_mods[MOD_BATCH_SIZE];
+   uint32_t skip_mods[MOD_BATCH_SIZE];
+   uint32_t batch_index = 0;
+   uint32_t batch_n = 0;
+   uint32_t k;
 
    int i;
 
-   for ( ; tdata->calculated_index < tdata->primelist_count; tdata->calculated_index++) {
-
-      po = &tdata->primelist[tdata->calculated_index];
-      sieve_prime = po->prime;
-      offsets = &tdata->offsets[tdata->calculated_index * 8];
+   for ( ; tdata->calculated_index < sctx->primelist_count; tdata->calculated_index++) {
 
-      for (i = 0; i < 8; i++)
-         offsets[num_to_bit(ind_to_mod[i] * sieve_prime)] = num_to_bytes(ind_to_mod[i] * sieve_prime);
+      sieve_prime = sctx->primelist[tdata->calculated_index];
+      next_offset = &tdata->next_offsets[tdata->calculated_index];
 
       /*
        * Mode 0 allows skipped primes to be added or reset primes to be reset and
@@ -160,15 +178,22 @@ check_new_sieve_primes(struct read_offs_thread_ctx *tdata, struct prime_current_
          if (sieve_prime * sieve_prime >= pcb->block_start_num)
             return;
 
-         po->offset = sieve_prime - (pcb->block_start_byte - skip * pcb->block_size) % sieve_prime;
+         if (tdata->calculated_index >= batch_index + batch_n) {
+            batch_index = tdata->calculated_index;
+            batch_n = get_mod_batch(sctx, batch_index, pcb->block_start_byte, skip * pcb->block_size, start_mods, skip_mods);
+         }
+         k = tdata->calculated_index - batch_index;
+
+         /* The block 'skip' blocks back can be before block 0 (after a skip_to) */
+         *next_offset = sieve_prime - sub_mod(start_mods[k], skip_mods[k], sieve_prime);
       }
       else {
          if (sieve_prime > pcb->sqrt_end_num)
             return;
 
-         compute_block_first_time(pcb, sieve_prime, &tdata->offsets[tdata->calculated_index * 8]);
+         compute_block_first_time(pcb, sieve_prime, &sctx->offsets[tdata->calculated_index * 8]);
 
-         po->offset = sieve_prime - pcb->block_start_byte % sieve_prime;
+         *next_offset = sieve_prime - pcb->block_start_byte % sieve_prime;
       }
 
       for (i = 10; i > 0; i--)
@@ -184,11 +209,78 @@ check_new_sieve_primes(struct read_offs_thread_ctx *tdata, struct prime_current_
 }
 
 
+static struct read_offs_thread_ctx *
+get_thread_data(struct read_offs_ctx *sctx, uint32_t thread_index)
+{
+   struct read_offs_thread_ctx *tdata = &sctx->thread_data[thread_index];
+
+   if (tdata->next_offsets == NULL)
+      tdata->next_offsets = malloc(sctx->next_offsets_size);
+   return tdata;
+}
+
+
+/*
+ * Calculate the offsets directly for the block containing target_num, stored
+ * as if the previous block had just been calculated.
+ */
+int
+read_offs_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
+{
+   struct read_offs_ctx        *sctx = ctx;
+   struct read_offs_thread_ctx *tdata = get_thread_data(sctx, pctx->thread_index);
+   struct prime_current_block   pcb = pctx->current_block;
+
+   pcb_set_block(&pcb, num_to_bytes(target_num) / pcb.block_size);
+
+   tdata->calculated_index = 0;
+   bzero(tdata->top10_index, sizeof tdata->top10_index);
+   bzero(tdata->top10_count, sizeof tdata->top10_count);
+   check_new_sieve_primes(sctx, tdata, &pcb, 1, 0);
+   tdata->last_blockno = pcb.block_num - 1;
+
+   return 0;
+}
+
+
+/*
+ * Move the offsets on past 'skip' blocks in one go, for skips too long to
+ * step through a block at a time. Each block takes the block size (mod the
+ * prime) off a prime's offset, or puts it back on for a negative skip.
+ */
+static void
+skip_blocks(struct read_offs_thread_ctx *tdata, const uint16_t *prime, const double *inverses, uint32_t block_size, int64_t skip)
+{
+   uint64_t bytes = (skip < 0 ? -skip : skip) * block_size;
+   uint32_t primes[MOD_BATCH_SIZE];
+   uint32_t mods[MOD_BATCH_SIZE];
+   uint32_t offset;
+   uint32_t i;
+   uint32_t n;
+   uint32_t k;
+
+   for (i = 0; i < tdata->calculated_index; i += n) {
+      n = MIN(MOD_BATCH_SIZE, tdata->calculated_index - i);
+      for (k = 0; k < n; k++)
+         primes[k] = prime[i + k];
+      mod_batch(bytes, primes, &inverses[i], mods, n);
+      if (skip < 0)
+         for (k = 0; k < n; k++)
+            mods[k] = mods[k] ? primes[k] - mods[k] : 0;
+
+      /* An offset can be the prime itself */
+      for (k = 0; k < n; k++) {
+         offset = tdata->next_offsets[i + k];
+         tdata->next_offsets[i + k] = sub_mod(offset - (offset >= primes[k] ? primes[k] : 0), mods[k], primes[k]);
+      }
+   }
+}
+
+
 static void
-compute_get_set_offsets(struct prime_current_block *pcb, struct prime_and_offset *po, uint16_t *offsets, int *offs, int skip, int n)
+compute_get_set_offsets(struct prime_current_block *pcb, int32_t sieve_prime, uint16_t *next_offset, const uint16_t *offsets, int *offs, int skip, int n)
 {
-   int32_t  sieve_prime = po->prime;
-   int32_t  offset      = po->offset;
+   int32_t  offset      = *next_offset;
    int      i;
 
    while (skip--) {
@@ -196,7 +288,7 @@ compute_get_set_offsets(struct prime_current_block *pcb, struct prime_and_offset
       offset += (offset>>31) & sieve_prime;
    }
 
-   po->offset = offset;
+   *next_offset = offset;
    offset -= sieve_prime;
 
    for (i = 0; i < 8; i++)
@@ -206,15 +298,14 @@ compute_get_set_offsets(struct prime_current_block *pcb, struct prime_and_offset
 
 /* the idea is that the inline remove the switch */
 static inline void __attribute__((always_inline))
-compute_block_n(struct prime_current_block *pcb, struct prime_and_offset *po, uint16_t *offsets, int skip, int n)
+compute_block_n(struct prime_current_block *pcb, uint32_t sieve_prime, uint16_t *next_offset, const uint16_t *offsets, int skip, int n)
 {
    const unsigned char bits[] = {0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80};
    char     *bmp;
-   uint32_t  sieve_prime = po->prime;
    int       offs[8];
    int       i;
 
-   compute_get_set_offsets(pcb, po, offsets, offs, skip, n - 1);
+   compute_get_set_offsets(pcb, sieve_prime, next_offset, offsets, offs, skip, n - 1);
 
    bmp = pcb->block;
 
@@ -263,18 +354,17 @@ compute_block_n(struct prime_current_block *pcb, struct prime_and_offset *po, ui
 
 
 static void
-compute_block_low(struct prime_current_block *pcb, struct prime_and_offset *po, uint16_t *offsets, int skip)
+compute_block_low(struct prime_current_block *pcb, int32_t sieve_prime, uint16_t *next_offset, const uint16_t *offsets, int skip)
 {
    const unsigned char bits[] = {0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80};
    char    *bmp;
-   int32_t  sieve_prime = po->prime;
    int      offs[8];
    int      n;
    int      i;
 
    n = pcb->block_size / sieve_prime + 1;
 
-   compute_get_set_offsets(pcb, po, offsets, offs, skip, n - 1);
+   compute_get_set_offsets(pcb, sieve_prime, next_offset, offsets, offs, skip, n - 1);
 
    for (bmp = pcb->block; n--; bmp += sieve_prime)
       for (i = 0; i < 8; i++)
@@ -287,20 +377,24 @@ int
 read_offs_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
 {
    struct read_offs_ctx        *sctx = ctx;
-   struct read_offs_thread_ctx *tdata = &sctx->thread_data[ptx->thread_index];
-   struct prime_and_offset     *po;
+   struct read_offs_thread_ctx *tdata = get_thread_data(sctx, ptx->thread_index);
    int64_t  skip = ptx->current_block.block_num - tdata->last_blockno;
+   int       restart = tdata->last_blockno == INT64_MAX || ptx->current_block.block_start_num <= sctx->end_prime;
    int       i;
-   uint16_t *offs;
+   const uint16_t *offs;
+   const uint16_t *prime;
+   uint16_t *next_offset;
 
-   if (tdata->primelist_count == 0)
+   if (sctx->primelist_count == 0)
       return 0;
 
-   if (tdata->primelist[0].prime == 7)
+   if (sctx->primelist[0] == 7)
       memset(ptx->current_block.block, 0, ptx->current_block.block_size);
 
-   if (skip < 0 || skip > 8) {
+   /* As in calc_offs, going back keeps the offsets once past the primes */
+   if (skip < 0 && restart) {
       tdata->calculated_index = 0;
+      bzero(tdata->top10_index, sizeof tdata->top10_index);
       bzero(tdata->top10_count, sizeof tdata->top10_count);
       skip = 0;
    }
@@ -309,10 +403,16 @@ read_offs_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
 
    i = 0;
 
-   offs = &tdata->offsets[0] - 8;
-   po = tdata->primelist;
+   offs = (const uint16_t *)get_node_replica(&sctx->offsets_nodes, ptx, sctx->offsets, sizeof(uint16_t) * 8 * sctx->primelist_count) - 8;
+   prime = get_node_replica(&sctx->primelist_nodes, ptx, sctx->primelist, sizeof(uint16_t) * sctx->primelist_count);
+   next_offset = tdata->next_offsets;
 
-   check_new_sieve_primes(tdata, &ptx->current_block, skip, 0);
+   if (skip < 0 || skip > 8) {
+      skip_blocks(tdata, prime, sctx->inverses, ptx->current_block.block_size, skip);
+      skip = 0;
+   }
+
+   check_new_sieve_primes(sctx, tdata, &ptx->current_block, skip, 0);
 
    /*
     * These didn't like being putting in a loop, presumably because of all of
@@ -321,45 +421,50 @@ read_offs_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
 
    i = tdata->top10_count[9];
    while (i--)
-      compute_block_low(&ptx->current_block, po++, (offs += 8), skip);
+      compute_block_low(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip);
 
    i = tdata->top10_count[8];
    while (i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 10);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 10);
 
    i = tdata->top10_count[7];
    while (i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 9);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 9);
 
    i = tdata->top10_count[6];
    while (i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 8);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 8);
 
    i = tdata->top10_count[5];
    while (i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 7);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 7);
 
    i = tdata->top10_count[4];
    while (i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 6);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 6);
 
    i = tdata->top10_count[3];
    while (i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 5);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 5);
 
    i = tdata->top10_count[2];
    while (i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 4);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 4);
 
    i = tdata->top10_count[1];
    while(i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 3);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 3);
 
    i = tdata->top10_count[0];
    while(i--)
-      compute_block_n(&ptx->current_block, po++, (offs += 8), skip, 2);
+      compute_block_n(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip, 2);
+
+   /* Primes larger than the block (ie small blocks) */
+   i = tdata->calculated_index - tdata->top10_index[0];
+   while(i--)
+      compute_block_low(&ptx->current_block, *prime++, next_offset++, (offs += 8), skip);
 
-   check_new_sieve_primes(tdata, &ptx->current_block, skip, 1);
+   check_new_sieve_primes(sctx, tdata, &ptx->current_block, skip, 1);
 
    return 0;
 }
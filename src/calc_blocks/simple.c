@@ -1,15 +1,24 @@
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 
 #include "misc.h"
 #include "wheel.h"
 #include "ctx.h"
 
+/*
+ * The primes are kept as the difference of their wheel index (ie byte * 8 +
+ * bit) from the previous prime. The differences always fit in a byte, so the
+ * list is a quarter of the size of the plain primes for the blocks to read
+ * through.
+ */
 struct simple_ctx
 {
    uint32_t  start_prime;
    uint32_t  end_prime;
-   uint32_t *primelist;
+   uint8_t  *index_diffs;
+   uint32_t  first_index;
+   uint32_t  last_index;
    uint32_t  primelist_count;
 };
 
@@ -23,7 +32,7 @@ simple_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_prime, vo
    sctx->start_prime = start_prime;
    sctx->end_prime = MIN(pctx->run_info.max_sieve_prime, end_prime);
 
-   sctx->primelist = malloc(sizeof(uint32_t) * (sctx->end_prime - start_prime) / 4 + 1000);
+   sctx->index_diffs = malloc((sctx->end_prime - start_prime) / 4 + 1000);
    sctx->primelist_count = 0;
 
    return 0;
@@ -34,7 +43,7 @@ int
 simple_free(void *ctx)
 {
    struct simple_ctx *sctx = ctx;
-   FREE(sctx->primelist);
+   FREE(sctx->index_diffs);
    FREE(ctx);
    return 0;
 }
@@ -44,13 +53,21 @@ int
 simple_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t size, void *ctx)
 {
    struct simple_ctx *sctx = ctx;
+   uint32_t index;
+
    for (; *ind < size; (*ind)++) {
       if (primelist[*ind] < sctx->start_prime)
          continue;
       if (primelist[*ind] > sctx->end_prime)
          return 0;
 
-      sctx->primelist[sctx->primelist_count++] = primelist[*ind];
+      index = pp_to_index(primelist[*ind]);
+      if (sctx->primelist_count == 0)
+         sctx->first_index = sctx->last_index = index;
+
+      assert(index - sctx->last_index <= UINT8_MAX);
+      sctx->index_diffs[sctx->primelist_count++] = index - sctx->last_index;
+      sctx->last_index = index;
    }
    return 0;
 }
@@ -71,8 +88,8 @@ simple_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
  * This does not overrun the buffer so should be safe for larger primes.
  * However, it will not be efficient for large primes due to all of the checking.
  *
- * No testing has been done for really large numbers which may affect the
- * pointer arithmetic.
+ * The offsets of the multiples are up to 29 * prime / 30 bytes which needs
+ * more than an int for the primes near 2^32.
  *
  * No state is stored which means it is inherently safe for threaded
  * calculations.
@@ -82,11 +99,11 @@ mark_off_prime(struct prime_current_block *pcb, uint32_t sieve_prime)
 {
    char     *bmp;
    int       i;
-   int       offsets[8];
+   int64_t   offsets[8];
    const unsigned char bits[]  = {0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80};
 
    for (i = 0; i < 8; i++)
-      offsets[pp_to_bit(ind_to_mod[i] * sieve_prime)] = num_to_bytes(ind_to_mod[i] * sieve_prime);
+      offsets[pp_to_bit((uint64_t)ind_to_mod[i] * sieve_prime)] = num_to_bytes((uint64_t)ind_to_mod[i] * sieve_prime);
 
    bmp = pcb_initial_offset(pcb, sieve_prime);
 
@@ -115,18 +132,23 @@ int
 simple_calc_primes(struct prime_thread_ctx *ptx, void *ctx)
 {
    struct simple_ctx *sctx = ctx;
+   uint32_t sieve_prime;
+   uint32_t index;
    uint32_t i;
 
    if (sctx->primelist_count == 0)
       return 0;
 
-   if (sctx->primelist[0] == 7)
+   if (index_to_pp(sctx->first_index) == 7)
       memset(ptx->current_block.block, 0, ptx->current_block.block_size);
 
+   index = sctx->first_index;
    for (i = 0; i < sctx->primelist_count; i++) {
-      if (sctx->primelist[i] > ptx->current_block.sqrt_end_num)
+      index += sctx->index_diffs[i];
+      sieve_prime = index_to_pp(index);
+      if (sieve_prime > ptx->current_block.sqrt_end_num)
          break;
-      mark_off_prime(&ptx->current_block, sctx->primelist[i]);
+      mark_off_prime(&ptx->current_block, sieve_prime);
    }
    return 0;
 }
@@ -48,6 +48,9 @@ simple_middle_init(struct prime_ctx *pctx, uint32_t start_prime, uint32_t end_pr
 
    sctx->nthreads = pctx->num_threads ?: 1;
    sctx->block_size = pctx->current_block->block_size;
+
+   /* n is the number of times a prime fits in the block */
+   assert(sctx->block_size / MAX(start_prime, 1) <= UINT16_MAX);
    sctx->thread_data = malloc(sctx->nthreads * sizeof(struct simple_middle_thread_ctx));
 
    sctx->primelist = malloc(sizeof(struct prime_and_n) * (sctx->end_prime - start_prime) / 4 + 1000);
@@ -96,24 +99,16 @@ simple_middle_add_sieving_primes(uint32_t *primelist, uint32_t *ind, uint32_t si
 }
 
 
-int
-simple_middle_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
-{
-   (void)pctx;
-   (void)target_num;
-
-   struct simple_middle_ctx *sctx = ctx;
-   /* Recalculate all of the offsets depending on the new block */
-   sctx->thread_data[pctx->thread_index].calculated_index = 0;
-   return 0;
-}
-
-
+/*
+ * Each bit is done separately so that primes larger than the block (which
+ * may or may not hit it) are handled the same as the others.
+ */
 static void
 compute_block_first_time(struct prime_current_block *pcb, uint32_t sieve_prime, uint16_t *next_offsets)
 {
    char     *bmp;
    int       i;
+   int64_t   off;
    int       offsets[8];
    const unsigned char bits[]  = {0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80};
 
@@ -122,22 +117,16 @@ compute_block_first_time(struct prime_current_block *pcb, uint32_t sieve_prime,
 
    bmp = pcb_initial_offset(pcb, sieve_prime);
 
-   for (i = 0; i < 8; i++)
-      if (pcb_inrange(pcb, bmp + offsets[i]))
-         *(bmp + offsets[i]) |= bits[i];
-
-   bmp += (bmp + sieve_prime < pcb_end(pcb)) ? sieve_prime : 0;
-
-   for ( ; bmp < pcb_end(pcb) - sieve_prime; bmp += sieve_prime)
-      for (i = 0; i < 8; i++)
-         *(bmp + offsets[i]) |= bits[i];
+   for (i = 0; i < 8; i++) {
+      off = bmp - pcb->block + offsets[i];
+      if (off < 0)
+         off += sieve_prime;
 
-   for (i = 0; i < 8; i++)
-      if (pcb_inrange(pcb, bmp + offsets[i]))
-         *(bmp + offsets[i]) |= bits[i];
+      for ( ; off < pcb->block_size; off += sieve_prime)
+         *(pcb->block + off) |= bits[i];
 
-   for (i = 0; i < 8; i++)
-      next_offsets[i] = (bmp + offsets[i]) - pcb_end(pcb) + ((bmp + offsets[i] < pcb_end(pcb)) ? sieve_prime : 0);
+      next_offsets[i] = off - pcb->block_size;
+   }
 }
 
 
@@ -158,6 +147,39 @@ check_new_sieve_primes(struct simple_middle_ctx *sctx, struct simple_middle_thre
 }
 
 
+/*
+ * Calculate the offsets directly for the block containing target_num. Only
+ * primes that are already past prime * prime are set, the others get added
+ * by check_new_sieve_primes() as usual.
+ */
+int
+simple_middle_skip_to(struct prime_thread_ctx *pctx, uint64_t target_num, void *ctx)
+{
+   struct simple_middle_ctx        *sctx = ctx;
+   struct simple_middle_thread_ctx *tdata = &sctx->thread_data[pctx->thread_index];
+   struct prime_current_block       pcb = pctx->current_block;
+   uint32_t sieve_prime;
+   int64_t  off;
+   int      i;
+
+   pcb_set_block(&pcb, num_to_bytes(target_num) / pcb.block_size);
+
+   for (tdata->calculated_index = 0; tdata->calculated_index < sctx->primelist_count; tdata->calculated_index++) {
+      sieve_prime = sctx->primelist[tdata->calculated_index].prime;
+
+      if ((uint64_t)sieve_prime * sieve_prime >= pcb.block_start_num)
+         break;
+
+      for (i = 0; i < 8; i++) {
+         off = num_to_bytes(ind_to_mod[i] * sieve_prime) - (int64_t)(pcb.block_start_byte % sieve_prime);
+         tdata->offsets[tdata->calculated_index * 8 + pp_to_bit(ind_to_mod[i] * sieve_prime)] = off + (off < 0 ? sieve_prime : 0);
+      }
+   }
+   tdata->last_blockno = pcb.block_num - 1;
+   return 0;
+}
+
+
 static void
 compute_block(struct prime_current_block *pcb, uint32_t sieve_prime, uint16_t *offsets, uint32_t n)
 {
@@ -81,14 +81,15 @@ mark_off_prime(struct prime_current_block *pcb, uint32_t sieve_prime)
 
    b = MAX(pcb->block_start_num / sieve_prime, sieve_prime) / 30 * 30;
 
+   /* Compare the multipliers so a multiple past 2^64 - 1 doesn't wrap */
    bit = 0;
-   while (sieve_prime * (b + ind_to_mod[bit]) < pcb->block_start_num)
+   while (b + ind_to_mod[bit] < pcb->block_start_num / sieve_prime + (pcb->block_start_num % sieve_prime != 0))
       if ((bit = (bit + 1) % 8) == 0)
          b += 30;
 
    for (;;) {
       for (; bit < 8; bit++) {
-         if (sieve_prime * (b + ind_to_mod[bit]) >= pcb->block_end_num)
+         if (b + ind_to_mod[bit] > (pcb->block_end_num - 1) / sieve_prime)
             return;
 
          set_bit(pcb, sieve_prime * (b + ind_to_mod[bit]));
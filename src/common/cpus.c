@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpus.h"
+
+#include "misc.h"
+
+
+struct cpu_info
+{
+   int cpu;
+   int package;
+   int core;
+   int sibling;    /* Index among the cpus of the core */
+   int core_rank;  /* Index of the core in the package */
+};
+
+
+static enum cpu_pinning cpu_pinning = PIN_SCATTER;
+
+
+static int
+read_int_file(const char *path, int def)
+{
+   FILE *f = fopen(path, "r");
+   int   val;
+
+   if (f == NULL)
+      return def;
+   if (fscanf(f, "%d", &val) != 1)
+      val = def;
+   fclose(f);
+   return val;
+}
+
+
+/*
+ * The allowed cpus in cpu order, with their position in the topology
+ */
+static int
+get_cpu_infos(struct cpu_info **infos)
+{
+   struct cpu_info *ci;
+   cpu_set_t        cpuset;
+   char             path[128];
+   int              count = 0;
+   int              cpu;
+   int              i;
+   int              k;
+
+   CPU_ZERO(&cpuset);
+   if (sched_getaffinity(0, sizeof cpuset, &cpuset) != 0) {
+      CPU_ZERO(&cpuset);
+      CPU_SET(0, &cpuset);
+   }
+
+   ci = calloc(CPU_COUNT(&cpuset), sizeof *ci);
+
+   for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &cpuset))
+         continue;
+
+      ci[count].cpu = cpu;
+      sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+      ci[count].package = read_int_file(path, 0);
+      sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+      ci[count].core = read_int_file(path, -1 - cpu);
+      count++;
+   }
+
+   for (i = 0; i < count; i++) {
+      for (k = 0; k < i; k++) {
+         if (ci[k].package != ci[i].package)
+            continue;
+         if (ci[k].core == ci[i].core) {
+            ci[i].sibling++;
+            ci[i].core_rank = ci[k].core_rank;
+         }
+         else if (ci[k].sibling == 0 && ci[i].sibling == 0) {
+            ci[i].core_rank++;
+         }
+      }
+   }
+
+   *infos = ci;
+   return count;
+}
+
+
+static int
+cmp_compact(const void *a, const void *b)
+{
+   const struct cpu_info *ca = a;
+   const struct cpu_info *cb = b;
+
+   if (ca->package != cb->package)
+      return ca->package - cb->package;
+   if (ca->core_rank != cb->core_rank)
+      return ca->core_rank - cb->core_rank;
+   return ca->sibling - cb->sibling;
+}
+
+
+static int
+cmp_scatter(const void *a, const void *b)
+{
+   const struct cpu_info *ca = a;
+   const struct cpu_info *cb = b;
+
+   if (ca->sibling != cb->sibling)
+      return ca->sibling - cb->sibling;
+   if (ca->core_rank != cb->core_rank)
+      return ca->core_rank - cb->core_rank;
+   return ca->package - cb->package;
+}
+
+
+/*
+ * cgroup v2 cpu.max is "quota period" (or "max period"), v1 has the two in
+ * separate files with a quota of -1 for none. Returns 0 if there is no limit.
+ */
+static int
+get_cgroup_cpu_limit(void)
+{
+   char  line[512];
+   char  path[600];
+   char  quota[32];
+   long  period = 0;
+   long  q = -1;
+   FILE *f;
+
+   /* Our own cgroup for v2 (the "0::" line), then the root of the mount */
+   path[0] = 0;
+   if ((f = fopen("/proc/self/cgroup", "r")) != NULL) {
+      while (fgets(line, sizeof line, f)) {
+         if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = 0;
+            snprintf(path, sizeof path, "/sys/fs/cgroup%s/cpu.max", line + 3);
+         }
+      }
+      fclose(f);
+   }
+
+   if ((path[0] && (f = fopen(path, "r")) != NULL) || (f = fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL) {
+      if (fscanf(f, "%31s %ld", quota, &period) == 2 && strcmp(quota, "max") != 0)
+         q = strtol(quota, NULL, 10);
+      fclose(f);
+   }
+   else {
+      q = read_int_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", -1);
+      period = read_int_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us", 0);
+   }
+
+   if (q <= 0 || period <= 0)
+      return 0;
+   return CEIL_DIV(q, period);
+}
+
+
+/******************************************************************************
+ *
+ * EXTERNAL FUNCTIONS
+ *
+ *****************************************************************************/
+
+void
+set_cpu_pinning(enum cpu_pinning pin)
+{
+   cpu_pinning = pin;
+}
+
+
+int
+parse_cpu_pinning(const char *str)
+{
+   if (strcmp(str, "scatter") == 0)
+      return PIN_SCATTER;
+   if (strcmp(str, "compact") == 0)
+      return PIN_COMPACT;
+   if (strcmp(str, "none") == 0)
+      return PIN_NONE;
+   return -1;
+}
+
+
+int
+get_auto_num_threads(void)
+{
+   struct cpu_info *ci;
+   int count = get_cpu_infos(&ci);
+   int cores = 0;
+   int limit = get_cgroup_cpu_limit();
+   int i;
+
+   for (i = 0; i < count; i++)
+      cores += ci[i].sibling == 0;
+   free(ci);
+
+   if (limit)
+      cores = MIN(cores, limit);
+   return MAX(cores, 1);
+}
+
+
+int
+resolve_num_threads(int nthreads)
+{
+   return nthreads == AUTO_NUM_THREADS ? get_auto_num_threads() : nthreads;
+}
+
+
+int
+get_pinning_cpus(int **cpus)
+{
+   struct cpu_info *ci;
+   int count;
+   int i;
+
+   *cpus = NULL;
+   if (cpu_pinning == PIN_NONE)
+      return 0;
+
+   count = get_cpu_infos(&ci);
+   qsort(ci, count, sizeof *ci, cpu_pinning == PIN_COMPACT ? cmp_compact : cmp_scatter);
+
+   *cpus = malloc(sizeof(int) * count);
+   for (i = 0; i < count; i++)
+      (*cpus)[i] = ci[i].cpu;
+   free(ci);
+   return count;
+}
+
+
+int
+get_cpu_node(int cpu)
+{
+   struct dirent *de;
+   DIR           *dir;
+   char           path[128];
+   int            node = 0;
+
+   sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+   if ((dir = opendir(path)) == NULL)
+      return 0;
+
+   while ((de = readdir(dir)) != NULL)
+      if (sscanf(de->d_name, "node%d", &node) == 1)
+         break;
+
+   closedir(dir);
+   return node;
+}
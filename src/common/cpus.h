@@ -0,0 +1,60 @@
+#ifndef _HARU_CPUS_H
+#define _HARU_CPUS_H
+
+/**
+ * @FILE Which cpus the threads run on
+ *
+ * Only the cpus in the process's affinity mask are used, which inside a
+ * container need not be 0..n-1. The topology comes from
+ * /sys/devices/system/cpu, a cpu with no topology there is taken to be a
+ * core of its own.
+ *
+ * The pinning applies to the pools started after it is set:
+ *   PIN_SCATTER - one thread per physical core (spread over the packages)
+ *                 before any shares a core (default)
+ *   PIN_COMPACT - fill each core's hyperthreads before moving to the next
+ *   PIN_NONE    - leave the threads to the scheduler
+ * Thread i gets the i'th cpu in that order, wrapping round when there are
+ * more threads than cpus.
+ *
+ * The numa node of a cpu is from the nodeN link in its sysfs directory.
+ */
+
+enum cpu_pinning {
+   PIN_SCATTER,
+   PIN_COMPACT,
+   PIN_NONE
+};
+
+
+/* nthreads = -1 means one thread per physical core */
+#define AUTO_NUM_THREADS (-1)
+
+/* Nodes past this share the last one's copies of the tables (see replica.h) */
+#define MAX_NUMA_NODES 16
+
+
+void set_cpu_pinning(enum cpu_pinning pin);
+
+/* "scatter", "compact" or "none", -1 for anything else */
+int parse_cpu_pinning(const char *str);
+
+/*
+ * The number of physical cores the process can use, limited by the cgroup
+ * cpu quota (cpu.max or cpu.cfs_quota_us) if there is one. At least 1.
+ */
+int get_auto_num_threads(void);
+
+/* nthreads, or get_auto_num_threads() for AUTO_NUM_THREADS */
+int resolve_num_threads(int nthreads);
+
+/*
+ * The cpus in pinning order (malloc'd), returns the count or 0 (and NULL)
+ * for PIN_NONE.
+ */
+int get_pinning_cpus(int **cpus);
+
+/* The numa node of the cpu, 0 if unknown */
+int get_cpu_node(int cpu);
+
+#endif
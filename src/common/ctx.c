@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <assert.h>
 
 #include "ctx.h"
 #include "plans.h"
+#include "pool.h"
+#include "prime.h"
+#include "cpus.h"
 
 
 static void
@@ -13,31 +16,33 @@ set_run_info(struct prime_run_info *rinfo, uint64_t start, uint64_t end, uint64_
    rinfo->start_num = start;
    rinfo->end_num   = end;
    rinfo->adjusted_start_num = FLOOR_TO(start, block_size);
-   rinfo->adjusted_end_num   = CEIL_TO(end + 1, block_size);
+   rinfo->adjusted_end_num   = FLOOR_TO(end, block_size) > UINT64_MAX - block_size ? UINT64_MAX
+                                                                                 : FLOOR_TO(end, block_size) + block_size;
 
-   rinfo->num_blocks = (rinfo->adjusted_end_num - rinfo->adjusted_start_num) / block_size;
+   rinfo->num_blocks = end / block_size - start / block_size + 1;
 
-   rinfo->max_sieve_prime = sqrtl(end);
+   rinfo->max_sieve_prime = isqrt(end);
    rinfo->added_sieve_primes = 0;
 }
 
 
 static void
-set_initial_block(struct prime_current_block *cb, uint32_t block_size)
+set_initial_block(struct prime_current_block *cb, uint32_t block_size, char *block)
 {
-   cb->block = (char*)aligned_alloc(32*1024, CEIL_TO(block_size + 64*1024 , 1024)) + 32*1024;
+   cb->block = block ?: alloc_block(block_size);
    cb->block_size = block_size;
    cb->block_start_num = 0;
    cb->block_end_num = bytes_to_num(block_size);
-   cb->sqrt_end_num = sqrtl(cb->block_end_num);
+   cb->sqrt_end_num = isqrt(cb->block_end_num);
 }
 
 
 static void
-free_initial_block(struct prime_current_block *cb)
+free_initial_block(struct prime_current_block *cb, struct prime_pool *pool)
 {
-   if (cb->block != NULL)
-      free(cb->block - 32*1024);
+   /* A pool's blocks are kept for its next run */
+   if (pool == NULL)
+      free_block(cb->block);
    bzero(cb, sizeof(*cb));
 }
 
@@ -49,8 +54,16 @@ set_plan(struct prime_ctx *pctx, const struct prime_plan *pp)
    pctx->plan_info.pp = pp;
    pctx->plan_info.plan_entry_ctxs = calloc(ARR_SIZEOF(pp->entries), sizeof (struct prime_plan_data));
 
-   for (i = 0; i < pp->num_entries; i++)
+   struct prime_current_block *whole = pctx->current_block;
+   struct prime_current_block  view = *whole;
+
+   /* Each entry sees the block size it will be called with */
+   pctx->current_block = &view;
+   for (i = 0; i < pp->num_entries; i++) {
+      view.block_size = pctx->block_size * pp->entries[i].block_multiplier;
       pp->entries[i].init(pctx, pp->entries[i].start, pp->entries[i].end, &pctx->plan_info.plan_entry_ctxs[i].data);
+   }
+   pctx->current_block = whole;
 }
 
 
@@ -69,29 +82,61 @@ free_plan(struct prime_ctx *pctx, const struct prime_plan *pp)
 }
 
 
+char *
+alloc_block(uint32_t block_size)
+{
+   return (char*)aligned_alloc(32*1024, CEIL_TO(block_size + 64*1024 , 1024)) + 32*1024;
+}
+
+
 void
-init_context(struct prime_ctx *pctx, uint64_t start, uint64_t end, int nthreads, const struct prime_plan *pp)
+free_block(char *block)
+{
+   if (block != NULL)
+      free(block - 32*1024);
+}
+
+
+static void
+init_context_threads(struct prime_ctx *pctx, uint64_t start, uint64_t end, int nthreads, struct prime_pool *pool, const struct prime_plan *pp, uint32_t block_size)
 {
    int i;
    bzero(pctx, sizeof *pctx);
 
-   set_run_info(&pctx->run_info, start, end, bytes_to_num(pp->block_size));
+   block_size = block_size ?: pp->block_size;
+   assert(block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0);
+
+   /* The blocks handed out are big enough for the largest multiplier */
+   pctx->block_size = block_size;
+   pctx->max_block_multiplier = 1;
+   for (i = 0; i < pp->num_entries; i++) {
+      assert((pp->entries[i].block_multiplier & (pp->entries[i].block_multiplier - 1)) == 0);
+      pctx->max_block_multiplier = MAX(pctx->max_block_multiplier, pp->entries[i].block_multiplier);
+   }
+   block_size *= pctx->max_block_multiplier;
+
+   set_run_info(&pctx->run_info, start, end, bytes_to_num(block_size));
    if (nthreads == 0) {
-      pctx->threads = calloc(sizeof *pctx->threads, 1);
-      set_initial_block (&pctx->threads[0].current_block, pp->block_size);
+      pctx->threads = aligned_alloc(128, sizeof *pctx->threads);
+      memset(pctx->threads, 0, sizeof *pctx->threads);
+      set_initial_block (&pctx->threads[0].current_block, block_size, NULL);
       pctx->current_block = &pctx->threads[0].current_block;
       pctx->threads[0].thread_index = 0;
       pctx->threads[0].main = pctx;
+      pctx->num_nodes = 1;
    }
    else {
       pctx->num_threads = nthreads;
-      pctx->threads = calloc(sizeof *pctx->threads, nthreads);
+      pctx->pool = pool;
+      pctx->num_nodes = pool->num_nodes;
+      pctx->threads = aligned_alloc(128, sizeof *pctx->threads * nthreads);
+      memset(pctx->threads, 0, sizeof *pctx->threads * nthreads);
+      prime_pool_alloc_blocks(pool, block_size);
       for (i = 0; i < nthreads; i++) {
-         set_initial_block (&pctx->threads[i].current_block, pp->block_size);
+         set_initial_block (&pctx->threads[i].current_block, block_size, pool->threads[i].block);
          pctx->threads[i].thread_index = i;
+         pctx->threads[i].node = pool->threads[i].node;
          pctx->threads[i].main = pctx;
-         sem_init(&pctx->threads[i].can_start_result, 0, 0);
-         sem_init(&pctx->threads[i].can_start_result_next, 0, 0);
       }
       pctx->current_block = &pctx->threads[0].current_block;
    }
@@ -99,17 +144,44 @@ init_context(struct prime_ctx *pctx, uint64_t start, uint64_t end, int nthreads,
 }
 
 
+void
+init_context(struct prime_ctx *pctx, uint64_t start, uint64_t end, int nthreads, const struct prime_plan *pp, uint32_t block_size)
+{
+   struct prime_pool *pool = NULL;
+
+   nthreads = resolve_num_threads(nthreads);
+   if (nthreads > 0) {
+      pool = malloc(sizeof *pool);
+      init_prime_pool(pool, nthreads);
+   }
+
+   init_context_threads(pctx, start, end, nthreads, pool, pp, block_size);
+   pctx->own_pool = pool != NULL;
+}
+
+
+void
+init_context_pool(struct prime_ctx *pctx, uint64_t start, uint64_t end, struct prime_pool *pool, const struct prime_plan *pp, uint32_t block_size)
+{
+   init_context_threads(pctx, start, end, pool->num_threads, pool, pp, block_size);
+}
+
+
 void
 free_context(struct prime_ctx *pctx) {
    uint32_t i;
-   for (i = 0; i < pctx->num_threads; i++) {
-      free_initial_block(&pctx->threads[i].current_block);
-      sem_destroy(&pctx->threads[i].can_start_result_next);
-      sem_destroy(&pctx->threads[i].can_start_result);
-   }
+
+   stop_calc_next_block(pctx);
+   for (i = 0; i < pctx->num_threads; i++)
+      free_initial_block(&pctx->threads[i].current_block, pctx->pool);
+   free_block_ring(&pctx->ring);
    if (pctx->num_threads == 0)
-      free_initial_block(&pctx->threads[0].current_block);
+      free_initial_block(&pctx->threads[0].current_block, NULL);
    free (pctx->threads);
    free_plan(pctx, pctx->plan_info.pp);
+   if (pctx->own_pool) {
+      free_prime_pool(pctx->pool);
+      free(pctx->pool);
+   }
    bzero(pctx, sizeof *pctx);
 }
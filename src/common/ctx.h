@@ -7,8 +7,11 @@
 
 #include "misc.h"
 #include "wheel.h"
+#include "ring.h"
+#include "cpus.h"
 
 struct prime_plan;
+struct prime_pool;
 
 /*
  * The main state for storing information about the run
@@ -23,7 +26,7 @@ struct prime_run_info
    uint64_t num_blocks;
 
    uint32_t max_sieve_prime;
-   uint32_t added_sieve_primes;
+   uint64_t added_sieve_primes;
 };
 
 
@@ -83,49 +86,110 @@ struct prime_results
  *
  * The next run can be chosen by a sync_add, so active threads
  * get more work
+ *--
+ * Third attempt (calc_blocks only, in order runs still take a block at a
+ * time and hand them over through the ring in ring.h)
+ *--
+ * Guided runs, a thread takes remaining / (2 * nthreads) blocks so the runs
+ * start large and shrink towards the end. Once all the blocks are taken an
+ * idle thread steals the back half of the biggest run left, so the threads
+ * finish at about the same time.
+ *
+ * On a numa machine the blocks are first split between the nodes, in
+ * proportion to their threads, and the runs are taken from the thread's own
+ * node's range (and stolen from threads on the same node) before any other.
  */
 
 struct prime_ctx;
 
 
+/* The blocks of a calc_blocks() run still to be handed out on a node */
+struct node_range
+{
+   uint64_t next;
+   uint64_t end;          /* Exclusive */
+   uint32_t num_threads;
+}__attribute__((aligned(64)));
+
+
 struct prime_thread_ctx
 {
-   union {
-      char padding[128];
-      struct {
-         pthread_t hdl;
-         struct prime_ctx *main;
-         struct prime_current_block current_block;
-         sem_t can_start_result;
-         int run_num;
-         uint32_t thread_index;
-      };
-   }__attribute__((__packed__));
-   union {
-      char padding2[64];
-      sem_t can_start_result_next;
-   }__attribute__((__packed__));
-}__attribute__((__packed__));
+   struct prime_ctx *main;
+   struct prime_current_block current_block;
+   int run_num;
+   uint32_t thread_index;
+   uint32_t node;          /* As the pool thread's node */
+
+   /* The thread's run, other threads can take the back of it (see above) */
+   uint64_t run_next __attribute__((aligned(128)));
+   uint64_t run_end;       /* Exclusive */
+   uint64_t blocks_done;
+   struct timespot idle;   /* Waiting for blocks, only r_diff is kept */
+   int      run_lock;
+   int      parked;        /* Past the pool's active count, its run is there to take whole */
+}__attribute__((aligned(128)));
 
 
+/*
+ * The blocks handed out to the threads are block_size * max_block_multiplier
+ * bytes. Plan entries with a smaller block_multiplier are run over each part
+ * of the block in turn.
+ */
 struct prime_ctx
 {
    uint64_t block_num;
+   uint64_t first_block_num;
+   uint64_t last_block_num;
    uint64_t process_block_num;
    uint32_t num_threads;
+   uint32_t num_nodes;
    uint32_t blocks_per_run;
-   int thread_i;
+   uint32_t block_size;
+   uint32_t max_block_multiplier;
    struct prime_run_info      run_info;
    struct prime_plan_info     plan_info;
    struct prime_results       results;
    struct prime_current_block *current_block;
    struct prime_thread_ctx   *threads;
+   struct prime_pool         *pool;
+   struct block_ring          ring;     /* In order runs only */
+   struct node_range          node_ranges[MAX_NUMA_NODES];
+   int own_pool;
    int run_state;
+   int working;                         /* Threads in the run which aren't parked */
+   int unpark_all;                      /* No one is left working, the parked threads finish up */
+   int stop;                            /* Cancelled or past the deadline, see calc_stopped() */
+   uint64_t deadline_us;                /* CLOCK_MONOTONIC, 0 for none */
 };
 
 
 
-void init_context(struct prime_ctx *pctx, uint64_t start, uint64_t end, int nthreads, const struct prime_plan *pp);
+/*
+ * block_size is in bytes and must be a power of two between MIN_BLOCK_SIZE
+ * and MAX_BLOCK_SIZE. 0 uses the block size of the plan. This is the block
+ * size for plan entries with a block_multiplier of 1.
+ *
+ * nthreads of 0 is single threaded, AUTO_NUM_THREADS (see cpus.h) is a thread
+ * per physical core.
+ */
+#define MIN_BLOCK_SIZE (16*1024)
+#define MAX_BLOCK_SIZE (1024*1024)
+
+void init_context(struct prime_ctx *pctx, uint64_t start, uint64_t end, int nthreads, const struct prime_plan *pp, uint32_t block_size);
 void free_context(struct prime_ctx *pctx);
 
+/*
+ * As init_context(), but the threads (and their blocks) are those of the pool
+ * rather than started for this context. init_context() with nthreads > 0
+ * uses a pool of its own.
+ */
+void init_context_pool(struct prime_ctx *pctx, uint64_t start, uint64_t end, struct prime_pool *pool, const struct prime_plan *pp, uint32_t block_size);
+
+/*
+ * The memory for a block of block_size bytes. There is some room either side
+ * of the block for the calc functions which run a little past its ends.
+ */
+char *alloc_block(uint32_t block_size);
+void free_block(char *block);
+
 #endif
@@ -0,0 +1,32 @@
+#include "fastmod.h"
+
+#include "misc.h"
+
+
+/* Adding and taking this off a double (below 2^51) rounds it to an integer */
+#define ROUND_MAGIC 4503599627370496.0
+
+
+void KERNEL_CLONES
+mod_batch(uint64_t n, const uint32_t *divs, const double *invs, uint32_t *mods, uint32_t count)
+{
+   const double hi = (double)(uint32_t)(n >> 32);
+   const double lo = (double)(uint32_t)n;
+   double p;
+   double a;
+   double r;
+   uint32_t i;
+
+   for (i = 0; i < count; i++) {
+      p = (int32_t)divs[i];
+
+      a = hi - ((hi * invs[i] + ROUND_MAGIC) - ROUND_MAGIC) * p;
+      a += a < 0 ? p : 0;
+
+      r = a * 4294967296.0 + lo;
+      r = r - ((r * invs[i] + ROUND_MAGIC) - ROUND_MAGIC) * p;
+      r += r < 0 ? p : 0;
+
+      mods[i] = (int32_t)r;
+   }
+}
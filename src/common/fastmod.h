@@ -0,0 +1,74 @@
+#ifndef _HARU_FASTMOD_H
+#define _HARU_FASTMOD_H
+
+#include <inttypes.h>
+
+/**
+ * @FILE The remainders of one number by many sieving primes, without a div each
+ *
+ * Setting up the offsets for a block (after a reset, a skip_to or a long skip)
+ * takes the block's start mod every sieving prime, which was a 64 bit
+ * division each. Here the number is split into 32 bit halves and each half is
+ * reduced by multiplying by the reciprocal of the prime in doubles:
+ *
+ *   a = hi mod p,  r = (a * 2^32 + lo) mod p
+ *
+ * Both quotients are under 2^32 and a * 2^32 + lo is under 2^53, so they are
+ * exact apart from the rounding of the reciprocal, which is at most one out
+ * and corrected by adding p back. The loop is simple enough for the compiler
+ * to do four primes at a time with AVX2 (in the clones, see misc.h).
+ *
+ * The reciprocals are worked out with mod_inverse() as the primes are added,
+ * and kept next to them. The divisors must be below MOD_BATCH_MAX_DIV.
+ */
+
+#define MOD_BATCH_MAX_DIV (1u << 21)
+
+/* The usual size of a batch, enough to keep the vectors busy */
+#define MOD_BATCH_SIZE 64
+
+
+static inline double
+mod_inverse(uint32_t div)
+{
+   return 1.0 / div;
+}
+
+
+/* mods[i] = n % divs[i] for i < count, invs[i] is mod_inverse(divs[i]) */
+void mod_batch(uint64_t n, const uint32_t *divs, const double *invs, uint32_t *mods, uint32_t count);
+
+
+/* (a - b) mod div, for a and b already below div */
+static inline uint32_t
+sub_mod(uint32_t a, uint32_t b, uint32_t div)
+{
+   return a >= b ? a - b : a + div - b;
+}
+
+
+/*
+ * For the primes up to 2^32, one at a time. recip is mod_inverse(div).
+ *
+ * n is rounded to 53 bits going into the double, so the estimate of the
+ * quotient is out by about q / 2^52, under one while div is at least 2^16.
+ * The remainder is then put back in [0, div) with one correction each way.
+ */
+#define DIV_RECIP_MIN_DIV (1u << 16)
+
+static inline uint64_t
+div_recip(uint64_t n, uint32_t div, double recip, uint32_t *mod)
+{
+   uint64_t q = (double)n * recip;
+   int64_t  r = n - q * div;
+
+   q -= r < 0;
+   r += r < 0 ? div : 0;
+   q += r >= div;
+   r -= r >= div ? div : 0;
+
+   *mod = r;
+   return q;
+}
+
+#endif
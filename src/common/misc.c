@@ -1,5 +1,7 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
 
 
 #include "misc.h"
@@ -70,3 +72,176 @@ print_v32_4ui(v32_4ui *a)
    }
 }
 
+
+
+/*
+ * A tiny recursive descent parser for numbers like "10^15+10^10" or "1e12"
+ *
+ *   expr   = term   { ('+' | '-') term }
+ *   term   = factor { '*' factor }
+ *   factor = number [ '^' factor ]
+ *   number = digits [ 'e' digits ] | '(' expr ')'
+ */
+static uint128_t parse_expr(const char *str, const char **p);
+
+static uint128_t
+checked_mul(const char *str, uint128_t a, uint128_t b)
+{
+   if (b != 0 && a > UINT128_MAX / b)
+      exit_error("Number too large: %s\n", str);
+   return a * b;
+}
+
+
+static uint128_t
+checked_pow(const char *str, uint128_t a, uint128_t b)
+{
+   uint128_t r = 1;
+
+   if (a <= 1)
+      return b == 0 ? 1 : a;
+   while (b--)
+      r = checked_mul(str, r, a);
+   return r;
+}
+
+
+static uint128_t
+checked_add(const char *str, uint128_t a, uint128_t b)
+{
+   if (a > UINT128_MAX - b)
+      exit_error("Number too large: %s\n", str);
+   return a + b;
+}
+
+
+/* The digits as for strtoull with base 0, but without the 64 bit limit */
+static uint128_t
+parse_digits(const char *str, const char **p)
+{
+   uint128_t r = 0;
+   int base = 10;
+   int d;
+
+   if (**p == '0' && ((*p)[1] == 'x' || (*p)[1] == 'X') && isxdigit((*p)[2])) {
+      base = 16;
+      *p += 2;
+   }
+   else if (**p == '0')
+      base = 8;
+
+   for (;; (*p)++) {
+      if (isdigit(**p))
+         d = **p - '0';
+      else if (base == 16 && isxdigit(**p))
+         d = tolower(**p) - 'a' + 10;
+      else
+         return r;
+
+      if (d >= base)
+         return r;
+      r = checked_add(str, checked_mul(str, r, base), d);
+   }
+}
+
+
+static uint128_t
+parse_number(const char *str, const char **p)
+{
+   uint128_t r;
+
+   if (**p == '(') {
+      (*p)++;
+      r = parse_expr(str, p);
+      if (**p != ')')
+         exit_error("Expected ')' in: %s\n", str);
+      (*p)++;
+      return r;
+   }
+
+   if (!isdigit(**p))
+      exit_error("Invalid number: %s\n", str);
+
+   r = parse_digits(str, p);
+
+   if (**p == 'e' || **p == 'E') {
+      (*p)++;
+      if (!isdigit(**p))
+         exit_error("Invalid number: %s\n", str);
+      r = checked_mul(str, r, checked_pow(str, 10, parse_digits(str, p)));
+   }
+   return r;
+}
+
+
+static uint128_t
+parse_factor(const char *str, const char **p)
+{
+   uint128_t r = parse_number(str, p);
+
+   if (**p == '^') {
+      (*p)++;
+      r = checked_pow(str, r, parse_factor(str, p));
+   }
+   return r;
+}
+
+
+static uint128_t
+parse_term(const char *str, const char **p)
+{
+   uint128_t r = parse_factor(str, p);
+
+   while (**p == '*') {
+      (*p)++;
+      r = checked_mul(str, r, parse_factor(str, p));
+   }
+   return r;
+}
+
+
+static uint128_t
+parse_expr(const char *str, const char **p)
+{
+   uint128_t r = parse_term(str, p);
+   uint128_t t;
+
+   for (;;) {
+      if (**p == '+') {
+         (*p)++;
+         r = checked_add(str, r, parse_term(str, p));
+      }
+      else if (**p == '-') {
+         (*p)++;
+         t = parse_term(str, p);
+         if (t > r)
+            exit_error("Number is negative: %s\n", str);
+         r -= t;
+      }
+      else
+         return r;
+   }
+}
+
+
+uint128_t
+parse_wide_num(const char *str)
+{
+   const char *p = str;
+   uint128_t r = parse_expr(str, &p);
+
+   if (*p != '\0')
+      exit_error("Invalid number: %s\n", str);
+   return r;
+}
+
+
+uint64_t
+parse_num(const char *str)
+{
+   uint128_t r = parse_wide_num(str);
+
+   if (r > UINT64_MAX)
+      exit_error("Number too large: %s\n", str);
+   return r;
+}
@@ -23,6 +23,17 @@
 
 #define FREE(A) do if (A) { free(A); (A) = NULL; } while (0)
 
+/* Marks a case that carries on into the next one (-Wimplicit-fallthrough) */
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define FALLTHROUGH __attribute__((fallthrough))
+#else
+#define FALLTHROUGH do { } while (0)
+#endif
+
+
+typedef unsigned __int128 uint128_t;
+#define UINT128_MAX ((uint128_t)-1)
+
 
 /*
  * For vector stuff
@@ -39,6 +50,24 @@ typedef int32_t       v32_8si __attribute__((vector_size(32)));
 typedef uint16_t      v32_16ui __attribute__((vector_size(32)));
 typedef int16_t       v32_16si __attribute__((vector_size(32)));
 
+/* An unaligned load, in whatever the clone below has to do it */
+#define LOAD_V32(P) ({ v32ui v_; __builtin_memcpy(&v_, (P), sizeof v_); v_; })
+
+/*
+ * The functions marked with this are built for each of these and the best one
+ * the cpu has is picked (by cpuid) when the program is loaded, so one build
+ * runs at full speed on any x86-64. arch=haswell is AVX2 with BMI2, default is
+ * plain x86-64 (SSE2). Without target_clones (before gcc 6, or clang) there is
+ * only the one build, and the Makefile builds it with -march=native.
+ */
+#if defined(__x86_64__) && !defined(__clang__) && __GNUC__ >= 6
+#define HAVE_KERNEL_CLONES 1
+#define KERNEL_CLONES __attribute__((target_clones("arch=haswell", "avx2", "sse4.2", "default")))
+#else
+#define HAVE_KERNEL_CLONES 0
+#define KERNEL_CLONES
+#endif
+
 void print_v16 (v16ui *a);
 void print_v32 (v32ui *a);
 void print_v32_4ui (v32_4ui *a);
@@ -159,6 +188,16 @@ void get_time_string(struct timespot *t);
  * Program related
  */
 
+/*
+ * Parse a number from the command line. Allows simple expressions such as
+ * "10^15+10^10", "1e12" or "2^32*3". Exits on an invalid or too large number.
+ */
+uint64_t parse_num(const char *str);
+
+/* As parse_num() for numbers up to 2^128 - 1 */
+uint128_t parse_wide_num(const char *str);
+
+
 #define exit_error(...) \
    do { \
       fprintf(stderr, __VA_ARGS__); \
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "pool.h"
+
+#include "misc.h"
+#include "ctx.h"
+#include "cpus.h"
+
+
+static void *
+pool_thread(void *data)
+{
+   struct prime_pool_thread *pt = data;
+   struct prime_pool        *pool = pt->pool;
+   uint64_t                  job_num = 0;
+   void                   *(*fn)(void *);
+   char                     *fn_data;
+   cpu_set_t                 cpuset;
+
+   /*
+    * Set the affinity - this appears to be needed to stop
+    * hiccups. See cpus.h for which cpu
+    */
+   if (pt->cpu >= 0) {
+      CPU_ZERO(&cpuset);
+      CPU_SET(pt->cpu, &cpuset);
+      sched_setaffinity(0, sizeof cpuset, &cpuset);
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   for (;;) {
+      while (pool->job_num == job_num && !pool->quit)
+         pthread_cond_wait(&pool->can_start, &pool->lock);
+
+      if (pool->quit)
+         break;
+
+      job_num = pool->job_num;
+      fn      = pool->fn;
+      fn_data = pool->data + pt->thread_index * pool->stride;
+      pthread_mutex_unlock(&pool->lock);
+
+      fn(fn_data);
+
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->running == 0)
+         pthread_cond_signal(&pool->done);
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   return NULL;
+}
+
+
+void
+init_prime_pool(struct prime_pool *pool, int nthreads)
+{
+   int  nodes[MAX_NUMA_NODES];
+   int *cpus;
+   int  ncpus;
+   int  node;
+   int  i;
+   int  k;
+
+   nthreads = resolve_num_threads(nthreads);
+   assert(nthreads > 0);
+   bzero(pool, sizeof *pool);
+
+   pool->num_threads = nthreads;
+   pool->active = nthreads;
+   pool->threads = calloc(nthreads, sizeof *pool->threads);
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->can_start, NULL);
+   pthread_cond_init(&pool->done, NULL);
+
+   ncpus = get_pinning_cpus(&cpus);
+
+   for (i = 0; i < nthreads; i++) {
+      pool->threads[i].pool = pool;
+      pool->threads[i].thread_index = i;
+      pool->threads[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+
+      /* Nodes are numbered in the order the threads come across them */
+      node = pool->threads[i].cpu >= 0 ? get_cpu_node(pool->threads[i].cpu) : 0;
+      for (k = 0; k < pool->num_nodes && nodes[k] != node; k++)
+         ;
+      if (k == pool->num_nodes && k < MAX_NUMA_NODES)
+         nodes[pool->num_nodes++] = node;
+      pool->threads[i].node = MIN(k, MAX_NUMA_NODES - 1);
+      pthread_create(&pool->threads[i].hdl, NULL, pool_thread, &pool->threads[i]);
+   }
+   free(cpus);
+}
+
+
+void
+free_prime_pool(struct prime_pool *pool)
+{
+   int i;
+
+   prime_pool_wait(pool);
+
+   pthread_mutex_lock(&pool->lock);
+   pool->quit = 1;
+   pthread_cond_broadcast(&pool->can_start);
+   pthread_mutex_unlock(&pool->lock);
+
+   for (i = 0; i < pool->num_threads; i++) {
+      pthread_join(pool->threads[i].hdl, NULL);
+      free_block(pool->threads[i].block);
+   }
+
+   pthread_cond_destroy(&pool->done);
+   pthread_cond_destroy(&pool->can_start);
+   pthread_mutex_destroy(&pool->lock);
+   FREE(pool->threads);
+   bzero(pool, sizeof *pool);
+}
+
+
+void
+prime_pool_start(struct prime_pool *pool, void *(*fn)(void *), void *data, size_t stride)
+{
+   pthread_mutex_lock(&pool->lock);
+   assert(pool->running == 0);
+
+   pool->fn      = fn;
+   pool->data    = data;
+   pool->stride  = stride;
+   pool->running = pool->num_threads;
+   pool->job_num++;
+
+   pthread_cond_broadcast(&pool->can_start);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+
+void
+prime_pool_wait(struct prime_pool *pool)
+{
+   pthread_mutex_lock(&pool->lock);
+   while (pool->running)
+      pthread_cond_wait(&pool->done, &pool->lock);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+
+void
+prime_pool_run(struct prime_pool *pool, void *(*fn)(void *), void *data, size_t stride)
+{
+   prime_pool_start(pool, fn, data, stride);
+   prime_pool_wait(pool);
+}
+
+
+void
+prime_pool_set_active(struct prime_pool *pool, int active)
+{
+   __atomic_store_n(&pool->active, MAX(1, MIN(active, pool->num_threads)), __ATOMIC_SEQ_CST);
+   prime_pool_wake_parked(pool);
+}
+
+
+/*
+ * park_seq is read before looking at active and unpark, and changes after
+ * either does, so the futex wait can't sleep through a change.
+ */
+void
+prime_pool_park(struct prime_pool *pool, int thread_index, const int *unpark)
+{
+   int seq;
+
+   for (;;) {
+      seq = __atomic_load_n(&pool->park_seq, __ATOMIC_SEQ_CST);
+      if (thread_index < __atomic_load_n(&pool->active, __ATOMIC_SEQ_CST)
+            || __atomic_load_n(unpark, __ATOMIC_SEQ_CST))
+         return;
+      syscall(SYS_futex, &pool->park_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+   }
+}
+
+
+void
+prime_pool_wake_parked(struct prime_pool *pool)
+{
+   __sync_fetch_and_add(&pool->park_seq, 1);
+   syscall(SYS_futex, &pool->park_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+
+static void *
+pool_alloc_block(void *data)
+{
+   struct prime_pool_thread *pt = data;
+   uint32_t block_size = pt->pool->alloc_block_size;
+
+   if (pt->block_size < block_size) {
+      free_block(pt->block);
+      pt->block = alloc_block(block_size);
+      pt->block_size = block_size;
+      memset(pt->block, 0, block_size);
+   }
+   return NULL;
+}
+
+
+void
+prime_pool_alloc_blocks(struct prime_pool *pool, uint32_t block_size)
+{
+   int i;
+
+   for (i = 0; i < pool->num_threads; i++)
+      if (pool->threads[i].block_size < block_size)
+         break;
+   if (i == pool->num_threads)
+      return;
+
+   pool->alloc_block_size = block_size;
+   prime_pool_run(pool, pool_alloc_block, pool->threads, sizeof *pool->threads);
+}
@@ -0,0 +1,94 @@
+#ifndef _HARU_POOL_H
+#define _HARU_POOL_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/**
+ * @FILE A pool of worker threads which can be handed one run after another
+ *
+ * Starting the threads, setting their affinity and allocating their blocks
+ * only happens once for the pool instead of for every run. A context created
+ * with init_context_pool() uses the pool's threads and borrows their blocks.
+ *
+ * Each thread allocates and first touches its own block, so on a numa machine
+ * the block is on the thread's node.
+ *
+ * A pool runs one thing at a time, so a context using it must be finished
+ * (or freed) before the pool is used by another.
+ *
+ * Only the first 'active' threads take new blocks, the others park. This can
+ * be changed during a long run, see prime_pool_set_active().
+ */
+
+
+struct prime_pool_thread
+{
+   pthread_t           hdl;
+   struct prime_pool  *pool;
+   int                 thread_index;
+   int                 cpu;          /* -1 when not pinned */
+   int                 node;         /* Index of the numa node, 0..num_nodes-1 */
+   char               *block;
+   uint32_t            block_size;
+};
+
+
+struct prime_pool
+{
+   int                        num_threads;
+   int                        num_nodes;
+   int                        active;
+   int                        park_seq;   /* Bumped (and woken) when a parked thread should look again */
+   struct prime_pool_thread  *threads;
+
+   pthread_mutex_t            lock;
+   pthread_cond_t             can_start;
+   pthread_cond_t             done;
+   uint64_t                   job_num;
+   int                        running;
+   int                        quit;
+
+   void                    *(*fn)(void *);
+   char                      *data;
+   size_t                     stride;
+
+   uint32_t                   alloc_block_size;  /* For prime_pool_alloc_blocks() */
+};
+
+
+/* nthreads can be AUTO_NUM_THREADS, the threads are pinned as set in cpus.h */
+void init_prime_pool(struct prime_pool *pool, int nthreads);
+void free_prime_pool(struct prime_pool *pool);
+
+/*
+ * Thread i of the pool calls fn(data + i * stride), ie each thread gets its
+ * element of an array, as with pthread_create() in a loop.
+ *
+ * prime_pool_start() returns straight away, prime_pool_wait() waits for all of
+ * the threads to return from fn.
+ */
+void prime_pool_start(struct prime_pool *pool, void *(*fn)(void *), void *data, size_t stride);
+void prime_pool_wait(struct prime_pool *pool);
+void prime_pool_run(struct prime_pool *pool, void *(*fn)(void *), void *data, size_t stride);
+
+/*
+ * The number of threads to take blocks from now on, 1..num_threads. A thread
+ * past it parks before its next block, and the others take over what it had
+ * left of its run. Can be called from a signal handler.
+ */
+void prime_pool_set_active(struct prime_pool *pool, int active);
+
+/* Parks until thread_index < active, or *unpark is set */
+void prime_pool_park(struct prime_pool *pool, int thread_index, const int *unpark);
+
+/* Wakes the parked threads to look at active and unpark again */
+void prime_pool_wake_parked(struct prime_pool *pool);
+
+/*
+ * Makes each thread's block (threads[i].block) at least block_size bytes, the
+ * blocks are kept between runs. Allocated as by alloc_block().
+ */
+void prime_pool_alloc_blocks(struct prime_pool *pool, uint32_t block_size);
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+
+#include "misc.h"
+
+
+void
+init_block_queue(struct block_queue *q, uint32_t size)
+{
+   memset(q, 0, sizeof *q);
+   q->size = size;
+   q->items = malloc(sizeof(struct prime_current_block *) * size);
+
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_cond_init(&q->not_empty, NULL);
+   pthread_cond_init(&q->not_full, NULL);
+}
+
+
+void
+free_block_queue(struct block_queue *q)
+{
+   pthread_cond_destroy(&q->not_full);
+   pthread_cond_destroy(&q->not_empty);
+   pthread_mutex_destroy(&q->lock);
+   FREE(q->items);
+}
+
+
+void
+block_queue_push(struct block_queue *q, struct prime_current_block *pcb)
+{
+   pthread_mutex_lock(&q->lock);
+   while (q->count == q->size)
+      pthread_cond_wait(&q->not_full, &q->lock);
+
+   q->items[(q->head + q->count++) % q->size] = pcb;
+   pthread_cond_signal(&q->not_empty);
+   pthread_mutex_unlock(&q->lock);
+}
+
+
+struct prime_current_block *
+block_queue_pop(struct block_queue *q)
+{
+   struct prime_current_block *pcb = NULL;
+
+   pthread_mutex_lock(&q->lock);
+   while (q->count == 0 && !q->closed)
+      pthread_cond_wait(&q->not_empty, &q->lock);
+
+   if (q->count) {
+      pcb = q->items[q->head];
+      q->head = (q->head + 1) % q->size;
+      q->count--;
+      pthread_cond_signal(&q->not_full);
+   }
+   pthread_mutex_unlock(&q->lock);
+   return pcb;
+}
+
+
+void
+block_queue_close(struct block_queue *q)
+{
+   pthread_mutex_lock(&q->lock);
+   q->closed = 1;
+   pthread_cond_broadcast(&q->not_empty);
+   pthread_mutex_unlock(&q->lock);
+}
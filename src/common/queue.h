@@ -0,0 +1,50 @@
+#ifndef _HARU_QUEUE_H
+#define _HARU_QUEUE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "wheel.h"
+
+/**
+ * @FILE A bounded queue of calculated blocks, for pipelined runs
+ *
+ * A pipelined run has a fixed set of block buffers going round two queues:
+ * the workers take a free buffer, sieve into it and push it on the ready
+ * queue, and the consumer threads take it from there and push it back on
+ * the free queue once they are done with it. The number of buffers bounds
+ * how far the sieving can get ahead of the consumers.
+ *
+ * Unlike the ring (ring.h) the blocks come out in whatever order they were
+ * finished. Pushing or popping a block is rare next to calculating one, so
+ * the queue is a plain mutex and condition variables.
+ */
+
+struct block_queue
+{
+   struct prime_current_block **items;
+   uint32_t                     size;
+   uint32_t                     head;
+   uint32_t                     count;
+   int                          closed;
+
+   pthread_mutex_t              lock;
+   pthread_cond_t               not_empty;
+   pthread_cond_t               not_full;
+};
+
+
+/* A queue with room for size blocks */
+void init_block_queue(struct block_queue *q, uint32_t size);
+void free_block_queue(struct block_queue *q);
+
+/* Waits while the queue is full */
+void block_queue_push(struct block_queue *q, struct prime_current_block *pcb);
+
+/* Waits for a block, NULL once the queue is closed and empty */
+struct prime_current_block *block_queue_pop(struct block_queue *q);
+
+/* No more blocks are coming, the waiting block_queue_pop() calls return */
+void block_queue_close(struct block_queue *q);
+
+#endif
@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "replica.h"
+
+#include "misc.h"
+#include "ctx.h"
+
+
+const void *
+get_node_replica(struct node_replica *nr, const struct prime_thread_ctx *ptx, const void *src, size_t size)
+{
+   const struct prime_ctx *pm = ptx->main;
+   void *copy;
+
+   if (pm->num_nodes <= 1 || pm->run_info.added_sieve_primes < pm->run_info.max_sieve_prime || size == 0)
+      return src;
+
+   copy = __atomic_load_n(&nr->copies[ptx->node], __ATOMIC_ACQUIRE);
+   if (copy != NULL)
+      return copy;
+
+   while (__sync_lock_test_and_set(&nr->lock, 1))
+      while (*(volatile int *)&nr->lock)
+         ;
+
+   copy = nr->copies[ptx->node];
+   if (copy == NULL) {
+      copy = aligned_alloc(64, CEIL_TO(size, 64));
+      memcpy(copy, src, size);
+      __atomic_store_n(&nr->copies[ptx->node], copy, __ATOMIC_RELEASE);
+   }
+
+   __sync_lock_release(&nr->lock);
+   return copy;
+}
+
+
+void
+free_node_replica(struct node_replica *nr)
+{
+   int i;
+
+   for (i = 0; i < MAX_NUMA_NODES; i++)
+      FREE(nr->copies[i]);
+}
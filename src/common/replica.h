@@ -0,0 +1,38 @@
+#ifndef _HARU_REPLICA_H
+#define _HARU_REPLICA_H
+
+#include <stddef.h>
+
+#include "cpus.h"
+
+struct prime_thread_ctx;
+
+/**
+ * @FILE Copies of a plan entry's shared tables on each numa node
+ *
+ * The tables of the sieving primes are written by the main thread, so they
+ * all sit on one node and the threads on the others read them across the
+ * interconnect for every block.
+ *
+ * Once all the sieving primes have been added the tables no longer change,
+ * and the first thread of each node to ask for a table copies it (the copy is
+ * on that node as the thread touches it first). Before then, or with only one
+ * node, the table itself is used.
+ */
+
+struct node_replica
+{
+   void *copies[MAX_NUMA_NODES];
+   int   lock;
+};
+
+
+/*
+ * The copy of src (size bytes) for ptx's node. The copy is 64 byte aligned so
+ * it can be read as vectors like the original.
+ */
+const void *get_node_replica(struct node_replica *nr, const struct prime_thread_ctx *ptx, const void *src, size_t size);
+
+void free_node_replica(struct node_replica *nr);
+
+#endif
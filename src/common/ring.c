@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+#include "misc.h"
+#include "ctx.h"
+
+
+/* Spins before sleeping, a block usually turns up in a few microseconds */
+#define RING_SPINS 4096
+
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#endif
+}
+
+
+static inline struct block_ring_slot *
+get_slot(struct block_ring *ring, uint64_t block_num)
+{
+   return &ring->slots[(block_num - ring->first_block) % ring->size];
+}
+
+
+static inline uint32_t
+get_seq(struct block_ring *ring, uint64_t block_num)
+{
+   return (uint32_t)(block_num - ring->first_block) * 2;
+}
+
+
+/*
+ * The waiters count is raised before the futex wait looks at seq again, and
+ * set_seq() looks at the count after changing seq, so a wake can't be missed.
+ */
+static int
+wait_seq(struct block_ring *ring, struct block_ring_slot *slot, uint32_t want)
+{
+   uint32_t cur;
+   int spins = 0;
+
+   while ((cur = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) != want) {
+      if (__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE))
+         return 0;
+
+      if (spins++ < RING_SPINS) {
+         cpu_relax();
+         continue;
+      }
+
+      __sync_fetch_and_add(&slot->waiters, 1);
+      syscall(SYS_futex, &slot->seq, FUTEX_WAIT_PRIVATE, cur, NULL, NULL, 0);
+      __sync_fetch_and_sub(&slot->waiters, 1);
+   }
+   return 1;
+}
+
+
+static void
+set_seq(struct block_ring_slot *slot, uint32_t seq)
+{
+   __atomic_store_n(&slot->seq, seq, __ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&slot->waiters, __ATOMIC_SEQ_CST))
+      syscall(SYS_futex, &slot->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+
+void
+init_block_ring(struct block_ring *ring, uint32_t size, uint32_t block_size, uint64_t first_block)
+{
+   uint32_t i;
+
+   bzero(ring, sizeof *ring);
+   ring->size = size;
+   ring->first_block = first_block;
+   ring->slots = aligned_alloc(128, sizeof(struct block_ring_slot) * size);
+   bzero(ring->slots, sizeof(struct block_ring_slot) * size);
+
+   for (i = 0; i < size; i++) {
+      ring->slots[i].seq = i * 2;
+      ring->slots[i].pcb.block = alloc_block(block_size);
+      ring->slots[i].pcb.block_size = block_size;
+   }
+}
+
+
+void
+free_block_ring(struct block_ring *ring)
+{
+   uint32_t i;
+
+   for (i = 0; i < ring->size; i++)
+      free_block(ring->slots[i].pcb.block);
+   FREE(ring->slots);
+   bzero(ring, sizeof *ring);
+}
+
+
+char *
+block_ring_wait_free(struct block_ring *ring, uint64_t block_num)
+{
+   struct block_ring_slot *slot = get_slot(ring, block_num);
+
+   if (!wait_seq(ring, slot, get_seq(ring, block_num)))
+      return NULL;
+   return slot->pcb.block;
+}
+
+
+void
+block_ring_put(struct block_ring *ring, const struct prime_current_block *pcb)
+{
+   struct block_ring_slot *slot = get_slot(ring, pcb->block_num);
+
+   slot->pcb = *pcb;
+   set_seq(slot, get_seq(ring, pcb->block_num) + 1);
+}
+
+
+struct prime_current_block *
+block_ring_wait_ready(struct block_ring *ring, uint64_t block_num)
+{
+   struct block_ring_slot *slot = get_slot(ring, block_num);
+
+   wait_seq(ring, slot, get_seq(ring, block_num) + 1);
+   return &slot->pcb;
+}
+
+
+void
+block_ring_release(struct block_ring *ring, uint64_t block_num)
+{
+   set_seq(get_slot(ring, block_num), get_seq(ring, block_num + ring->size));
+}
+
+
+/*
+ * Changing each seq makes a thread about to sleep on it look again, and see
+ * the ring has stopped.
+ */
+void
+block_ring_stop(struct block_ring *ring)
+{
+   uint32_t i;
+
+   __atomic_store_n(&ring->stop, 1, __ATOMIC_SEQ_CST);
+   for (i = 0; i < ring->size; i++)
+      set_seq(&ring->slots[i], ring->slots[i].seq + 1);
+}
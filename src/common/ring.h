@@ -0,0 +1,67 @@
+#ifndef _HARU_RING_H
+#define _HARU_RING_H
+
+#include <inttypes.h>
+
+#include "wheel.h"
+
+/**
+ * @FILE The calculated blocks of an in order run, waiting to be handed over
+ *
+ * Block n goes in slot n % size. A thread with block n waits until the slot
+ * has been handed back for block n (ie block n - size has been used), fills
+ * it and marks it ready. calc_next_block() waits for block n to be ready in
+ * its slot and hands it back once it moves on to block n + 1.
+ *
+ * With size > nthreads a thread can be a block or so ahead rather than
+ * waiting for its last block to be used before starting the next.
+ *
+ * The state of a slot is a single sequence number, so waiting on it spins for
+ * a little then sleeps on a futex.
+ */
+
+/* Number of slots per thread */
+#define RING_BLOCKS_PER_THREAD 2
+
+
+/* A slot to itself in each pair of cache lines */
+struct block_ring_slot
+{
+   uint32_t seq;      /* 2 * n when free for block n, 2 * n + 1 once it holds block n */
+   uint32_t waiters;
+   struct prime_current_block pcb;
+}__attribute__((aligned(128)));
+
+
+struct block_ring
+{
+   struct block_ring_slot *slots;
+   uint32_t                size;
+   uint64_t                first_block;
+   int                     stop;
+};
+
+
+/* The slots hold blocks of block_size bytes, starting with block first_block */
+void init_block_ring(struct block_ring *ring, uint32_t size, uint32_t block_size, uint64_t first_block);
+void free_block_ring(struct block_ring *ring);
+
+/*
+ * For the thread with block_num. Waits for the slot to be free and returns
+ * the memory to calculate the block in, NULL once the ring is stopped.
+ */
+char *block_ring_wait_free(struct block_ring *ring, uint64_t block_num);
+
+/* pcb (pcb->block is from block_ring_wait_free()) is ready to be handed over */
+void block_ring_put(struct block_ring *ring, const struct prime_current_block *pcb);
+
+/* Waits for block_num to be ready */
+struct prime_current_block *block_ring_wait_ready(struct block_ring *ring, uint64_t block_num);
+
+/* block_num has been used, its slot can take the block size blocks on */
+void block_ring_release(struct block_ring *ring, uint64_t block_num);
+
+/* Wakes any waiting threads, block_ring_wait_free() returns NULL from now on */
+void block_ring_stop(struct block_ring *ring);
+
+#endif
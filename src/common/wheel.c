@@ -1,3 +1,5 @@
+#include <math.h>
+
 #include "wheel.h"
 
 uint64_t
@@ -36,6 +38,52 @@ bytes_to_num(uint64_t bytes)
 }
 
 
+uint64_t
+pp_to_index(uint64_t num)
+{
+   return num_to_bytes(num) * 8 + pp_to_bit(num);
+}
+
+
+uint64_t
+index_to_pp(uint64_t index)
+{
+   return bytes_to_num(index >> 3) + ind_to_mod[index & 7];
+}
+
+
+uint64_t
+isqrt(uint64_t num)
+{
+   uint64_t r = sqrtl(num);
+
+   while (r > UINT32_MAX || r * r > num)
+      r--;
+   while (r < UINT32_MAX && (r + 1) * (r + 1) <= num)
+      r++;
+   return r;
+}
+
+
+/*
+ * The numbers of a block past 2^64 - 1 can't be represented, so the block
+ * numbers saturate at UINT64_MAX. Nothing is lost since UINT64_MAX is a
+ * multiple of 15, and the end of the run masks the rest of the block.
+ */
+void
+pcb_set_block(struct prime_current_block *pcb, uint64_t block_num)
+{
+   const uint64_t max_byte = num_to_bytes(UINT64_MAX);
+
+   pcb->block_num        = block_num;
+   pcb->block_start_byte = pcb->block_num * pcb->block_size;
+   pcb->block_start_num  = pcb->block_start_byte > max_byte ? UINT64_MAX : bytes_to_num(pcb->block_start_byte);
+   pcb->block_end_num    = pcb->block_start_byte + pcb->block_size > max_byte ? UINT64_MAX
+                                                                            : bytes_to_num(pcb->block_start_byte + pcb->block_size);
+   pcb->sqrt_end_num     = isqrt(pcb->block_end_num);
+}
+
+
 char *
 pcb_end(struct prime_current_block *pcb)
 {
@@ -17,7 +17,7 @@ struct prime_current_block
    char     *block;
    uint32_t  block_size;
    uint64_t  block_start_num;
-   uint64_t  block_end_num;
+   uint64_t  block_end_num;      /* Saturates at UINT64_MAX for the last block */
    uint64_t  sqrt_end_num;
 
    uint64_t  block_start_byte;
@@ -41,6 +41,26 @@ uint64_t num_to_bit(uint64_t num);
 /* Note: This is the number 1 more than that covered by bytes (ie 1 byte covers 30 nums) */
 uint64_t bytes_to_num(uint64_t bytes);
 
+/*
+ * The position of a possible prime in the wheel (ie byte * 8 + bit), and back.
+ * Consecutive primes below 2^32 are at most 90 apart in the wheel.
+ */
+uint64_t pp_to_index(uint64_t num);
+uint64_t index_to_pp(uint64_t index);
+
+/*
+ * floor(sqrt(num)) for the full uint64_t range. sqrtl alone can round up to
+ * the next integer for numbers close to a square.
+ */
+uint64_t isqrt(uint64_t num);
+
+
+/**
+ * Set the block numbers/offsets for the given block number (block_size must
+ * already be set). This does not touch the block memory.
+ */
+void pcb_set_block(struct prime_current_block *pcb, uint64_t block_num);
+
 
 /**
  * The byte just past the end of the block
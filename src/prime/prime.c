@@ -17,6 +17,8 @@
 #include "plans.h"
 #include "wheel.h"
 #include "ctx.h"
+#include "pool.h"
+#include "queue.h"
 #include "initial.h"
 
 
@@ -60,12 +62,7 @@ apply_start_end_sets (struct prime_thread_ctx *ptx)
    char *t;
    uint64_t byte;
    uint32_t bit;
-   /* If the block is in the middle, then return */
-   if (ptx->current_block.block_start_num > ptx->main->run_info.start_num
-         &&
-       ptx->current_block.block_end_num < ptx->main->run_info.end_num) {
-      return;
-   }
+   uint32_t mod;
 
    if (ptx->current_block.block_start_num < ptx->main->run_info.start_num) {
       byte = num_to_bytes(ptx->main->run_info.start_num);
@@ -78,9 +75,17 @@ apply_start_end_sets (struct prime_thread_ctx *ptx)
          memset (ptx->current_block.block, 0xff, (t - ptx->current_block.block));
    }
 
-   if (ptx->current_block.block_end_num > ptx->main->run_info.end_num) {
-      byte = num_to_bytes(ptx->main->run_info.end_num + 1);
-      bit  = num_to_bit(ptx->main->run_info.end_num + 1);
+   /*
+    * The numbers after end_num are marked starting from end_num + 1, without
+    * calculating end_num + 1 which can overflow
+    */
+   if (ptx->current_block.block_end_num > ptx->main->run_info.end_num
+         ||
+       ptx->current_block.block_end_num == UINT64_MAX) {
+      byte = num_to_bytes(ptx->main->run_info.end_num);
+      mod  = ptx->main->run_info.end_num % 30 + 1;
+      bit  = mod == 30 ? 0 : mod_to_ind[mod];
+      byte += mod == 30;
 
       t =  ptx->current_block.block + byte - num_to_bytes(ptx->current_block.block_start_num);
       *t |= ~0ul << bit;
@@ -90,59 +95,92 @@ apply_start_end_sets (struct prime_thread_ctx *ptx)
    }
 }
 
+/*
+ * Set 'view' to part 'k' of the whole block for a plan entry with the given
+ * block multiplier
+ */
 static void
-calc_block_threaded (struct prime_thread_ctx *ptx)
+set_block_view (struct prime_ctx *pm, struct prime_current_block *view, const struct prime_current_block *whole, uint32_t multiplier, uint32_t k)
 {
-   int i;
-   struct prime_ctx *pm = ptx->main;
-   struct prime_current_block *pcb = &ptx->current_block;
+   uint32_t nviews = pm->max_block_multiplier / multiplier;
 
-   for (i = 0; i < pm->plan_info.pp->num_entries; i++) {
-
-      if (pcb->sqrt_end_num > pm->plan_info.pp->entries[i].start)
-         pm->plan_info.pp->entries[i].calc_primes(ptx, pm->plan_info.plan_entry_ctxs[i].data);
-
-   }
+   view->block      = whole->block + k * pm->block_size * multiplier;
+   view->block_size = pm->block_size * multiplier;
+   pcb_set_block(view, whole->block_num * nviews + k);
 }
 
+
 /*
  * Run each of the functions associated to the different prime ranges
  * to calculate each block
+ *
+ * Consecutive entries with the same block multiplier are run on each part of
+ * the block in turn, so the small primes are all done while that part is in
+ * the L1 cache.
  */
 static void
-calc_block (struct prime_ctx *pctx) {
+calc_block_entries (struct prime_thread_ctx *ptx, const int timed)
+{
+   struct prime_ctx           *pm = ptx->main;
+   const struct prime_plan    *pp = pm->plan_info.pp;
+   struct prime_current_block  whole = ptx->current_block;
+   uint32_t nviews;
+   uint32_t k;
    int i;
-   for (i = 0; i < pctx->plan_info.pp->num_entries; i++) {
-      mark_time(&pctx->plan_info.plan_entry_ctxs[i].timer);
+   int j;
+   int e;
+
+   for (i = 0; i < pp->num_entries; i = j) {
+      for (j = i; j < pp->num_entries && pp->entries[j].block_multiplier == pp->entries[i].block_multiplier; j++)
+         ;
 
-      if (pctx->current_block->sqrt_end_num > pctx->plan_info.pp->entries[i].start)
-         pctx->plan_info.pp->entries[i].calc_primes(&pctx->threads[0], pctx->plan_info.plan_entry_ctxs[i].data);
+      nviews = pm->max_block_multiplier / pp->entries[i].block_multiplier;
 
-      add_timediff(&pctx->plan_info.plan_entry_ctxs[i].timer);
+      for (k = 0; k < nviews; k++) {
+         if (nviews > 1)
+            set_block_view(pm, &ptx->current_block, &whole, pp->entries[i].block_multiplier, k);
+
+         for (e = i; e < j; e++) {
+            if (timed)
+               mark_time(&pm->plan_info.plan_entry_ctxs[e].timer);
+
+            if (ptx->current_block.sqrt_end_num > pp->entries[e].start)
+               pp->entries[e].calc_primes(ptx, pm->plan_info.plan_entry_ctxs[e].data);
+
+            if (timed)
+               add_timediff(&pm->plan_info.plan_entry_ctxs[e].timer);
+         }
+      }
+      ptx->current_block = whole;
    }
 }
 
 
 static void
-get_next_block_single (struct prime_current_block *pcb)
+calc_block_threaded (struct prime_thread_ctx *ptx)
 {
-   pcb->block_start_num  += bytes_to_num(pcb->block_size);
-   pcb->block_end_num    += bytes_to_num(pcb->block_size);
-   pcb->sqrt_end_num      = sqrtl(pcb->block_end_num);
-   pcb->block_start_byte += pcb->block_size;
-   pcb->block_num++;
-   return;
+   calc_block_entries(ptx, 0);
 }
 
 
 static void
-set_block (struct prime_current_block *pcb, uint64_t block_num)
+calc_block (struct prime_ctx *pctx) {
+   calc_block_entries(&pctx->threads[0], 1);
+}
+
+
+static void
+get_next_block_single (struct prime_current_block *pcb)
 {
-   pcb->block_num        = block_num;
-   pcb->block_start_byte = pcb->block_num * pcb->block_size;
-   pcb->block_start_num  = bytes_to_num(pcb->block_start_byte);
-   pcb->block_end_num    = pcb->block_start_num + bytes_to_num(pcb->block_size);
-   pcb->sqrt_end_num     = sqrtl(pcb->block_end_num);
+   pcb_set_block(pcb, pcb->block_num + 1);
+}
+
+
+/* Compared in bytes as the numbers of a block past the end can overflow */
+static int
+past_end_block (struct prime_ctx *ctx, struct prime_current_block *pcb)
+{
+   return pcb->block_start_byte > num_to_bytes(ctx->run_info.end_num);
 }
 
 
@@ -154,8 +192,252 @@ get_next_block (struct prime_thread_ctx *ptx)
    }
    else {
       ptx->run_num = ptx->main->blocks_per_run - 1;
-      set_block (&ptx->current_block, __sync_fetch_and_add(&ptx->main->block_num, ptx->main->blocks_per_run));
+      pcb_set_block (&ptx->current_block, __sync_fetch_and_add(&ptx->main->block_num, ptx->main->blocks_per_run));
+   }
+}
+
+
+static inline void
+lock_run (struct prime_thread_ctx *ptx)
+{
+   while (__sync_lock_test_and_set(&ptx->run_lock, 1))
+      while (*(volatile int *)&ptx->run_lock)
+         ;
+}
+
+
+static inline void
+unlock_run (struct prime_thread_ctx *ptx)
+{
+   __sync_lock_release(&ptx->run_lock);
+}
+
+
+static void
+set_run (struct prime_thread_ctx *ptx, uint64_t start, uint64_t end)
+{
+   lock_run(ptx);
+   ptx->run_next = start;
+   ptx->run_end = end;
+   unlock_run(ptx);
+}
+
+
+/*
+ * Take the next run from the blocks of the node range that haven't been
+ * handed out. The run is a share of what is left, but never less than
+ * blocks_per_run.
+ */
+static int
+claim_range_run (struct prime_thread_ctx *ptx, struct node_range *nr)
+{
+   struct prime_ctx *pm = ptx->main;
+   uint64_t start;
+   uint64_t end;
+   uint64_t len;
+
+   for (;;) {
+      start = *(volatile uint64_t *)&nr->next;
+      end = nr->end;
+      if (start >= end)
+         return 0;
+
+      len = end - start;
+      len = MIN(len, MAX(pm->blocks_per_run, len / (2 * nr->num_threads)));
+
+      if (__sync_bool_compare_and_swap(&nr->next, start, start + len)) {
+         set_run(ptx, start, start + len);
+         return 1;
+      }
+   }
+}
+
+
+/* The thread's own node first, then the others */
+static int
+claim_run (struct prime_thread_ctx *ptx)
+{
+   struct prime_ctx *pm = ptx->main;
+   uint32_t i;
+
+   for (i = 0; i < pm->num_nodes; i++)
+      if (claim_range_run(ptx, &pm->node_ranges[(ptx->node + i) % pm->num_nodes]))
+         return 1;
+   return 0;
+}
+
+
+/*
+ * Take the back half of the largest run another thread has left, looking at
+ * the threads on the same node first. The owner keeps going from the front,
+ * so both threads still work through contiguous blocks. Runs too short to be
+ * worth restarting the sieve state for are left. A parked thread's run is
+ * taken whole, however short.
+ */
+static int
+steal_run (struct prime_thread_ctx *ptx)
+{
+   struct prime_ctx        *pm = ptx->main;
+   struct prime_thread_ctx *victim = NULL;
+   uint64_t min_steal = MAX(1, pm->blocks_per_run / 8);
+   uint64_t best = 0;
+   uint64_t left;
+   uint64_t half;
+   uint32_t i;
+   int      same_node;
+   int      parked;
+
+   for (same_node = 1; same_node >= 0 && victim == NULL; same_node--) {
+      for (i = 0; i < pm->num_threads; i++) {
+         if (&pm->threads[i] == ptx || (pm->threads[i].node == ptx->node) != same_node)
+            continue;
+
+         left = *(volatile uint64_t *)&pm->threads[i].run_end - *(volatile uint64_t *)&pm->threads[i].run_next;
+         parked = *(volatile int *)&pm->threads[i].parked;
+         if ((int64_t)left > (int64_t)best && (parked ? (int64_t)left > 0 : left / 2 >= min_steal)) {
+            best = left;
+            victim = &pm->threads[i];
+         }
+      }
+   }
+
+   if (victim == NULL)
+      return 0;
+
+   lock_run(victim);
+   half = victim->run_end > victim->run_next ? victim->run_end - victim->run_next : 0;
+   if (!victim->parked)
+      half /= 2;
+   if (half < (victim->parked ? 1 : min_steal)) {
+      unlock_run(victim);
+      return 1; /* Someone else got there first, look again */
+   }
+   victim->run_end -= half;
+   unlock_run(victim);
+
+   set_run(ptx, victim->run_end, victim->run_end + half);
+   return 1;
+}
+
+
+/* Split the blocks from block_num to last_block_num by the threads on each node */
+static void
+set_node_ranges (struct prime_ctx *ctx)
+{
+   uint64_t blocks = ctx->last_block_num + 1 - ctx->block_num;
+   uint64_t start = ctx->block_num;
+   uint32_t threads = 0;
+   uint32_t n;
+   uint32_t i;
+
+   for (n = 0; n < ctx->num_nodes; n++)
+      ctx->node_ranges[n].num_threads = 0;
+   for (i = 0; i < ctx->num_threads; i++)
+      ctx->node_ranges[ctx->threads[i].node].num_threads++;
+
+   for (n = 0; n < ctx->num_nodes; n++) {
+      threads += ctx->node_ranges[n].num_threads;
+      ctx->node_ranges[n].next = start;
+      ctx->node_ranges[n].end = ctx->block_num + (uint64_t)((uint128_t)blocks * threads / ctx->num_threads);
+      ctx->node_ranges[n].num_threads = MAX(1, ctx->node_ranges[n].num_threads);
+      start = ctx->node_ranges[n].end;
+   }
+}
+
+
+/*
+ * get_next_block() for calc_blocks(), see the third attempt in ctx.h. Once
+ * there is nothing left the block is set past the end.
+ */
+static void
+get_next_block_guided (struct prime_thread_ctx *ptx)
+{
+   struct prime_ctx *pm = ptx->main;
+   uint64_t block;
+
+   for (;;) {
+      lock_run(ptx);
+      if (ptx->run_next < ptx->run_end) {
+         block = ptx->run_next++;
+         unlock_run(ptx);
+         pcb_set_block(&ptx->current_block, block);
+         return;
+      }
+      unlock_run(ptx);
+
+      if (!claim_run(ptx) && !steal_run(ptx))
+         break;
+   }
+
+   pcb_set_block(&ptx->current_block, pm->last_block_num + 1);
+}
+
+
+/*
+ * Park a thread past the pool's active count until it is let back in. Its
+ * kernel state is kept for then, and the others take what is left of its
+ * run. The last working thread doesn't park, and once the last one has left
+ * the run the parked threads all carry on so no blocks are stranded with
+ * them.
+ */
+static void
+park_thread (struct prime_thread_ctx *ptx)
+{
+   struct prime_ctx *pm = ptx->main;
+
+   lock_run(ptx);
+   ptx->parked = 1;
+   unlock_run(ptx);
+
+   if (__sync_sub_and_fetch(&pm->working, 1) != 0) {
+      mark_time(&ptx->idle);
+      prime_pool_park(pm->pool, ptx->thread_index, &pm->unpark_all);
+      add_timediff(&ptx->idle);
+   }
+   __sync_fetch_and_add(&pm->working, 1);
+
+   lock_run(ptx);
+   ptx->parked = 0;
+   unlock_run(ptx);
+}
+
+
+static void
+leave_run (struct prime_thread_ctx *ptx)
+{
+   struct prime_ctx *pm = ptx->main;
+
+   if (__sync_sub_and_fetch(&pm->working, 1) == 0) {
+      __atomic_store_n(&pm->unpark_all, 1, __ATOMIC_SEQ_CST);
+      prime_pool_wake_parked(pm->pool);
+   }
+}
+
+
+/* The time each thread spent waiting after its last block until the end */
+static void
+add_tail_idle (struct prime_ctx *ctx)
+{
+   uint32_t i;
+
+   for (i = 0; i < ctx->num_threads; i++)
+      add_timediff(&ctx->threads[i].idle);
+}
+
+
+static void
+reset_thread_stats (struct prime_ctx *ctx)
+{
+   uint32_t i;
+
+   for (i = 0; i < ctx->num_threads; i++) {
+      ctx->threads[i].run_next = ctx->threads[i].run_end = 0;
+      ctx->threads[i].blocks_done = 0;
+      ctx->threads[i].parked = 0;
+      init_time(&ctx->threads[i].idle);
    }
+   ctx->working = ctx->num_threads;
+   ctx->unpark_all = 0;
 }
 
 
@@ -184,7 +466,7 @@ add_sieve_primes(struct prime_ctx *ctx, uint32_t *primelist, uint32_t size)
 static void
 get_some_primes_from_current_block(struct prime_thread_ctx *ptx, uint32_t *primelist, int *size, int max_size, uint32_t *cur_nbytes, uint32_t *cur_bit)
 {
-   uint32_t prime;
+   uint64_t prime;
    while ((prime = get_next_prime(&ptx->current_block, cur_nbytes, cur_bit)) != 0) {
 
       if (prime <= ptx->main->run_info.added_sieve_primes)
@@ -221,15 +503,111 @@ add_sieve_primes_from_current_block(struct prime_thread_ctx *ptx)
 }
 
 
+/*
+ * Get all the sieving primes in the current block, for the threaded sieving
+ * pass. The count of unmarked bits is an upper bound on the number of primes
+ * which is good enough to size the list.
+ */
+static uint32_t *
+get_primes_from_current_block(struct prime_thread_ctx *ptx, uint32_t *count)
+{
+   const uint64_t *words = (const uint64_t *)ptx->current_block.block;
+   uint32_t *primelist;
+   uint32_t max_count = 0;
+   uint32_t byte = 0;
+   uint32_t bit = 0;
+   uint64_t prime;
+   uint32_t i;
+
+   for (i = 0; i < ptx->current_block.block_size / 8; i++)
+      max_count += __builtin_popcountll(~words[i]);
+
+   primelist = malloc(sizeof(uint32_t) * (max_count ?: 1));
+   *count = 0;
+
+   while ((prime = get_next_prime(&ptx->current_block, &byte, &bit)) != 0) {
+      if (prime > ptx->main->run_info.max_sieve_prime)
+         break;
+      primelist[(*count)++] = prime;
+   }
+   return primelist;
+}
+
+
 /******************************************************************************
  * Thread Main functions
  *****************************************************************************/
 
+/*
+ * A wave of blocks for the threaded sieving pass. Every block in the wave only
+ * needs sieving primes which have already been added, so the blocks can be
+ * calculated in any order and their primes added in order afterwards.
+ */
+struct sieving_wave {
+   struct prime_ctx  *ctx;
+   uint64_t           first_block;
+   uint64_t           end_block;
+   uint64_t           next_block;
+   uint32_t         **primelists;
+   uint32_t          *counts;
+};
+
+
+struct sieving_thread_data {
+   struct sieving_wave     *wave;
+   struct prime_thread_ctx *ptx;
+};
+
+
+static void *
+thread_calc_sieving_primes(void *data)
+{
+   struct sieving_thread_data *tdata = data;
+   struct sieving_wave        *wave = tdata->wave;
+   struct prime_thread_ctx    *ptx = tdata->ptx;
+   uint64_t                    block;
+
+   while ((block = __sync_fetch_and_add(&wave->next_block, 1)) < wave->end_block) {
+      pcb_set_block(&ptx->current_block, block);
+      calc_block_threaded(ptx);
+      wave->primelists[block - wave->first_block] =
+         get_primes_from_current_block(ptx, &wave->counts[block - wave->first_block]);
+   }
+   return NULL;
+}
+
+
+/*
+ * The buffers of a pipelined run (see queue.h), each worker can have this
+ * many ready and waiting for a consumer before it waits for one to come
+ * back.
+ */
+#define PIPE_BLOCKS_PER_THREAD 2
+
+struct block_pipe {
+   struct block_queue          free;
+   struct block_queue          ready;
+   struct prime_current_block *bufs;
+   uint32_t                    num_bufs;
+   int                         stop;
+   int (*fn)(const struct prime_current_block *, uint32_t, void *);
+   void                       *th;
+};
+
+
+struct consumer_data {
+   struct block_pipe *pipe;
+   uint32_t           index;
+   pthread_t          hdl;
+};
+
+
 struct thread_data {
    struct prime_thread_ctx *ptx;
    int inorder;
    int (*fn)(struct prime_thread_ctx *, void *);
    void *th;
+   struct block_pipe *pipe;
 };
 
 
@@ -240,34 +618,62 @@ thread_calc_block(void *data)
    struct prime_thread_ctx    *ptx = tdata->ptx;
    struct prime_ctx           *pm = ptx->main;
    struct prime_current_block *pcb = &ptx->current_block;
-   cpu_set_t                   cpuset;
-
-   /*
-    * Set the affinity - this appears to be needed to stop
-    * hiccups. Currently no checking is done if nthreads > ncpu
-    */
-   CPU_ZERO(&cpuset);
-   CPU_SET(ptx->thread_index, &cpuset);
-   sched_setaffinity(0, sizeof cpuset, &cpuset);
+   struct prime_current_block *buf = NULL;
+   char                       *own_block = pcb->block;
 
    for (;;) {
 
-      get_next_block(ptx);
+      if (tdata->pipe && *(volatile int *)&tdata->pipe->stop)
+         break;
 
-      if (pcb->block_start_num > pm->run_info.end_num)
+      /* In order the reader stops the run, see stop_calc_next_block() */
+      if (!tdata->inorder && calc_stopped(pm))
          break;
 
+      if (ptx->thread_index >= (uint32_t)__atomic_load_n(&pm->pool->active, __ATOMIC_RELAXED)
+            && !__atomic_load_n(&pm->unpark_all, __ATOMIC_RELAXED))
+         park_thread(ptx);
+
+      if (tdata->inorder)
+         get_next_block(ptx);
+      else
+         get_next_block_guided(ptx);
+
+      if (past_end_block(pm, pcb))
+         break;
+
+      /* In order the block is calculated straight into its slot of the ring */
+      if (tdata->inorder) {
+         mark_time(&ptx->idle);
+         pcb->block = block_ring_wait_free(&pm->ring, pcb->block_num);
+         add_timediff(&ptx->idle);
+         if (pcb->block == NULL)
+            break;
+      }
+
+      /* Pipelined it goes in a free buffer which is handed on to a consumer */
+      if (tdata->pipe) {
+         mark_time(&ptx->idle);
+         buf = block_queue_pop(&tdata->pipe->free);
+         add_timediff(&ptx->idle);
+         pcb->block = buf->block;
+      }
+
       calc_block_threaded(ptx);
+      __atomic_store_n(&ptx->blocks_done, ptx->blocks_done + 1, __ATOMIC_RELAXED);
 
       if (pcb->block_start_num == 0)
          apply_zero_block_mod (pcb);
 
-      if (pcb->block_start_num < pm->run_info.start_num || pcb->block_end_num > pm->run_info.end_num)
+      if (pcb->block_start_num < pm->run_info.start_num || pcb->block_end_num >= pm->run_info.end_num)
          apply_start_end_sets(ptx);
 
       if (tdata->inorder) {
-         sem_post(&ptx->can_start_result);
-         sem_wait(&ptx->can_start_result_next);
+         block_ring_put(&pm->ring, pcb);
+      }
+      else if (tdata->pipe) {
+         *buf = *pcb;
+         block_queue_push(&tdata->pipe->ready, buf);
       }
       else {
          if (tdata->fn(ptx, tdata->th))
@@ -275,6 +681,29 @@ thread_calc_block(void *data)
       }
    }
 
+   pcb->block = own_block;
+   leave_run(ptx);
+   mark_time(&ptx->idle);
+   return NULL;
+}
+
+
+/*
+ * Once a consumer's fn asks to stop, the rest of the blocks are just handed
+ * back so the workers can run out.
+ */
+static void *
+consume_blocks(void *data)
+{
+   struct consumer_data       *cd = data;
+   struct block_pipe          *pipe = cd->pipe;
+   struct prime_current_block *buf;
+
+   while ((buf = block_queue_pop(&pipe->ready)) != NULL) {
+      if (!*(volatile int *)&pipe->stop && pipe->fn(buf, cd->index, pipe->th))
+         pipe->stop = 1;
+      block_queue_push(&pipe->free, buf);
+   }
    return NULL;
 }
 
@@ -299,11 +728,58 @@ thread_calc_block_inorder(void *thunk)
  * It leaves ctx->block_num pointing to the start of the first block so that
  * get_next_block() will return the first target block
  *
- * TODO: use threads if threaded (potentially in-order threads)
+ * The blocks are calculated in order on thread 0 until the sieving primes up
+ * to sqrt(max_sieve_prime) are known. The remaining blocks don't need any
+ * more sieving primes, so they are calculated by all the threads in waves and
+ * their primes added in order between the waves.
  */
+static void
+calc_sieving_primes_threaded (struct prime_ctx *ctx, uint64_t end_block)
+{
+   struct sieving_wave         wave = { .ctx = ctx };
+   struct sieving_thread_data *tdata;
+   uint64_t                    wave_size = ctx->num_threads * 4;
+   uint32_t                    i;
+
+   tdata   = malloc(sizeof(struct sieving_thread_data) * ctx->num_threads);
+   wave.primelists = malloc(sizeof(uint32_t *) * wave_size);
+   wave.counts     = malloc(sizeof(uint32_t) * wave_size);
+
+   for (wave.first_block = ctx->threads[0].current_block.block_num + 1;
+        wave.first_block < end_block;
+        wave.first_block = wave.end_block) {
+
+      wave.end_block  = MIN(end_block, wave.first_block + wave_size);
+      wave.next_block = wave.first_block;
+
+      for (i = 0; i < ctx->num_threads; i++) {
+         tdata[i].wave = &wave;
+         tdata[i].ptx  = &ctx->threads[i];
+      }
+
+      prime_pool_run(ctx->pool, thread_calc_sieving_primes, tdata, sizeof *tdata);
+
+      for (i = 0; i < wave.end_block - wave.first_block; i++) {
+         add_sieve_primes(ctx, wave.primelists[i], wave.counts[i]);
+         FREE(wave.primelists[i]);
+      }
+   }
+
+   pcb_set_block(&ctx->threads[0].current_block, end_block - 1);
+   ctx->run_info.added_sieve_primes = ctx->threads[0].current_block.block_end_num;
+
+   FREE(wave.counts);
+   FREE(wave.primelists);
+   FREE(tdata);
+}
+
+
 static void
 calc_sieving_primes (struct prime_ctx *ctx)
 {
+   struct prime_current_block whole;
+   uint64_t end_block;
+   uint64_t end_num;
    int i;
 
    ctx->block_num = 0;
@@ -317,16 +793,31 @@ calc_sieving_primes (struct prime_ctx *ctx)
    apply_zero_block_mod (&ctx->threads[0].current_block);
    add_sieve_primes_from_current_block(&ctx->threads[0]);
 
+   /* The block containing max_sieve_prime is the last one needed */
+   end_block = num_to_bytes(ctx->run_info.max_sieve_prime) / ctx->threads[0].current_block.block_size + 1;
+   end_num   = bytes_to_num(end_block * ctx->threads[0].current_block.block_size);
+
    while (ctx->threads[0].current_block.block_end_num < ctx->run_info.max_sieve_prime) {
+      if (ctx->num_threads > 1
+            && ctx->threads[0].current_block.block_end_num >= isqrt(end_num)) {
+         calc_sieving_primes_threaded(ctx, end_block);
+         break;
+      }
       get_next_block(&ctx->threads[0]);
       calc_block_threaded(&ctx->threads[0]);
       add_sieve_primes_from_current_block(&ctx->threads[0]);
    }
 
    ctx->block_num = ctx->run_info.start_num / 30 / ctx->threads[0].current_block.block_size;
+   ctx->first_block_num = ctx->block_num;
+   ctx->last_block_num = num_to_bytes(ctx->run_info.end_num) / ctx->threads[0].current_block.block_size;
    ctx->process_block_num = ctx->block_num;
-   for (i = 0; i < ctx->plan_info.pp->num_entries; i++)
-      ctx->plan_info.pp->entries[i].skip_to(&ctx->threads[0], ctx->block_num * ctx->threads[0].current_block.block_size * 30, ctx->plan_info.plan_entry_ctxs[i].data);
+   whole = ctx->threads[0].current_block;
+   for (i = 0; i < ctx->plan_info.pp->num_entries; i++) {
+      ctx->threads[0].current_block.block_size = ctx->block_size * ctx->plan_info.pp->entries[i].block_multiplier;
+      ctx->plan_info.pp->entries[i].skip_to(&ctx->threads[0], ctx->block_num * whole.block_size * 30, ctx->plan_info.plan_entry_ctxs[i].data);
+   }
+   ctx->threads[0].current_block = whole;
 
    for (i = 0; i < (int)ctx->num_threads; i++)
       ctx->threads[i].run_num = 0;
@@ -339,44 +830,31 @@ calc_next_block_single (struct prime_ctx *ctx)
    if (ctx->run_state == 0) {
       calc_sieving_primes(ctx);
       ctx->threads[0].run_num = 0;
-      set_block (&ctx->threads[0].current_block, ctx->block_num - 1);
+      pcb_set_block (&ctx->threads[0].current_block, ctx->block_num - 1);
+      ctx->threads[0].blocks_done = 0;
       ctx->run_state = 1;
    }
 
    get_next_block_single(&ctx->threads[0].current_block);
 
-   if (ctx->current_block->block_start_num >= ctx->run_info.end_num)
+   if (past_end_block(ctx, ctx->current_block))
       return 0;
 
    calc_block(ctx);
+   __atomic_store_n(&ctx->threads[0].blocks_done, ctx->threads[0].blocks_done + 1, __ATOMIC_RELAXED);
    apply_zero_block_mod (&ctx->threads[0].current_block);
    apply_start_end_sets(&ctx->threads[0]);
    return 1;
 }
 
 
-/* Thread id that is currently processing the next block */
-static int
-get_next_thread_id(struct prime_ctx *ctx)
-{
-   uint32_t i;
-   for (;;) {
-      for (i = 0; i < ctx->num_threads; i++)
-         if (ctx->threads[i].current_block.block_num == ctx->process_block_num)
-            return i;
-      sched_yield();
-   }
-
-}
-
-
 /*
  * The threaded version of "get_next_block"
  *
  * The general idea is:
- *   - wait for block to be processed
+ *   - wait for the block to be ready in the ring
  *   - return (calling process uses the current block)
- *   - when next called, signal to thread that the block is done
+ *   - when next called, hand the block's slot back for the threads to reuse
  *
  */
 static int
@@ -389,32 +867,30 @@ calc_next_block_th (struct prime_ctx *ctx)
       ctx->blocks_per_run = 1;
 
       calc_sieving_primes(ctx);
+      reset_thread_stats(ctx);
 
-      for (i = 0; i < ctx->num_threads; i++) {
+      init_block_ring(&ctx->ring, ctx->num_threads * RING_BLOCKS_PER_THREAD,
+                      ctx->threads[0].current_block.block_size, ctx->process_block_num);
+
+      for (i = 0; i < ctx->num_threads; i++)
          ctx->threads[i].run_num = 0;
-         ctx->threads[i].current_block.block_num = INT64_MAX;
-         pthread_create(&ctx->threads[i].hdl, NULL, thread_calc_block_inorder, &ctx->threads[i]);
-      }
+      prime_pool_start(ctx->pool, thread_calc_block_inorder, ctx->threads, sizeof *ctx->threads);
    }
    else {
 
       if (ctx->current_block->block_end_num >= ctx->run_info.end_num) {
-         for (i = 0; i < ctx->num_threads; i++)
-            sem_post(&ctx->threads[i].can_start_result_next);
-
-         for (i = 0; i < ctx->num_threads; i++)
-            pthread_join(ctx->threads[i].hdl, NULL);
+         prime_pool_wait(ctx->pool);
+         add_tail_idle(ctx);
+         ctx->run_state = 2;
 
          return 0; /* DONE */
       }
 
-      sem_post(&ctx->threads[ctx->thread_i].can_start_result_next);
+      block_ring_release(&ctx->ring, ctx->process_block_num);
       ctx->process_block_num++;
    }
 
-   ctx->thread_i = get_next_thread_id(ctx);
-   sem_wait(&ctx->threads[ctx->thread_i].can_start_result);
-   ctx->current_block = &ctx->threads[ctx->thread_i].current_block;
+   ctx->current_block = block_ring_wait_ready(&ctx->ring, ctx->process_block_num);
    return 1;
 }
 
@@ -433,8 +909,29 @@ calc_next_block (struct prime_ctx *ctx)
 }
 
 
-int
-calc_blocks (struct prime_ctx *ctx, int (*fn)(struct prime_thread_ctx *, void *), void *thunk)
+/*
+ * An in order run which is stopped early still has its threads waiting for
+ * slots in the ring. Every block they pick up from now on is past the end, so
+ * stopping the ring finishes them.
+ */
+void
+stop_calc_next_block (struct prime_ctx *ctx)
+{
+   if (ctx->num_threads == 0 || ctx->run_state != 1)
+      return;
+
+   ctx->block_num = ctx->last_block_num + 1;
+   block_ring_stop(&ctx->ring);
+
+   prime_pool_wait(ctx->pool);
+   add_tail_idle(ctx);
+   ctx->run_state = 2;
+}
+
+
+/* The sieving primes and the runs, ready for the threads to calculate blocks */
+static struct thread_data *
+start_calc_blocks (struct prime_ctx *ctx, int (*fn)(struct prime_thread_ctx *, void *), void *thunk, struct block_pipe *pipe)
 {
    uint32_t i;
    struct thread_data *tdata = calloc(sizeof *tdata, ctx->num_threads);
@@ -444,19 +941,100 @@ calc_blocks (struct prime_ctx *ctx, int (*fn)(struct prime_thread_ctx *, void *)
       tdata[i].inorder = 0;
       tdata[i].fn = fn;
       tdata[i].th = thunk;
+      tdata[i].pipe = pipe;
       tdata[i].ptx = &ctx->threads[i];
    }
 
-   ctx->blocks_per_run = ctx->run_info.end_num > 32*1024*32*1024 ? 64 : 1;
+   /*
+    * Longer runs for larger sieving primes since the bucket sieve needs to
+    * re-calculate the position of every large prime at the start of a run.
+    * This is the shortest run handed out, see get_next_block_guided().
+    */
+   ctx->blocks_per_run = ctx->run_info.end_num > 32*1024*32*1024 ? MAX(64, ctx->run_info.max_sieve_prime >> 14) / ctx->max_block_multiplier : 1;
+   ctx->blocks_per_run = MAX(1, MIN(ctx->blocks_per_run, ctx->run_info.num_blocks / ctx->num_threads));
 
    calc_sieving_primes(ctx);
+   reset_thread_stats(ctx);
+   set_node_ranges(ctx);
 
-   for (i = 0; i < ctx->num_threads; i++)
-      pthread_create(&ctx->threads[i].hdl, NULL, thread_calc_block, &tdata[i]);
+   return tdata;
+}
 
-   for (i = 0; i < ctx->num_threads; i++)
-      pthread_join(ctx->threads[i].hdl, NULL);
 
+int
+calc_stopped (struct prime_ctx *ctx)
+{
+   struct timespec now;
+
+   if (__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED))
+      return 1;
+   if (ctx->deadline_us == 0)
+      return 0;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   if ((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 < ctx->deadline_us)
+      return 0;
+
+   __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELAXED);
+   return 1;
+}
+
+
+int
+calc_blocks (struct prime_ctx *ctx, int (*fn)(struct prime_thread_ctx *, void *), void *thunk)
+{
+   struct thread_data *tdata = start_calc_blocks(ctx, fn, thunk, NULL);
+
+   prime_pool_run(ctx->pool, thread_calc_block, tdata, sizeof *tdata);
+   add_tail_idle(ctx);
+
+   free(tdata);
+
+   return 0;
+}
+
+
+int
+calc_blocks_pipelined (struct prime_ctx *ctx, uint32_t nconsumers, int (*fn)(const struct prime_current_block *, uint32_t, void *), void *thunk)
+{
+   struct block_pipe     pipe = { .fn = fn, .th = thunk };
+   struct consumer_data *cdata;
+   struct thread_data   *tdata;
+   uint32_t              block_size = ctx->threads[0].current_block.block_size;
+   uint32_t              i;
+
+   tdata = start_calc_blocks(ctx, NULL, NULL, &pipe);
+
+   pipe.num_bufs = ctx->num_threads * PIPE_BLOCKS_PER_THREAD + nconsumers;
+   pipe.bufs = calloc(sizeof *pipe.bufs, pipe.num_bufs);
+   init_block_queue(&pipe.free, pipe.num_bufs);
+   init_block_queue(&pipe.ready, pipe.num_bufs);
+   for (i = 0; i < pipe.num_bufs; i++) {
+      pipe.bufs[i].block = alloc_block(block_size);
+      pipe.bufs[i].block_size = block_size;
+      block_queue_push(&pipe.free, &pipe.bufs[i]);
+   }
+
+   cdata = calloc(sizeof *cdata, nconsumers);
+   for (i = 0; i < nconsumers; i++) {
+      cdata[i].pipe = &pipe;
+      cdata[i].index = i;
+      pthread_create(&cdata[i].hdl, NULL, consume_blocks, &cdata[i]);
+   }
+
+   prime_pool_run(ctx->pool, thread_calc_block, tdata, sizeof *tdata);
+   add_tail_idle(ctx);
+
+   block_queue_close(&pipe.ready);
+   for (i = 0; i < nconsumers; i++)
+      pthread_join(cdata[i].hdl, NULL);
+
+   for (i = 0; i < pipe.num_bufs; i++)
+      free_block(pipe.bufs[i].block);
+   free_block_queue(&pipe.ready);
+   free_block_queue(&pipe.free);
+   free(pipe.bufs);
+   free(cdata);
    free(tdata);
 
    return 0;
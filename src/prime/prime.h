@@ -1,13 +1,35 @@
 #ifndef _HARU_PRIME_H
 #define _HARU_PRIME_H
 
+#include <inttypes.h>
+
 struct prime_ctx;
 struct prime_thread_ctx;
+struct prime_current_block;
 
 int calc_next_block (struct prime_ctx *ctx);
 
+/* Finish the threads of a calc_next_block() run that wasn't run to the end */
+void stop_calc_next_block (struct prime_ctx *ctx);
+
+/*
+ * The run has been cancelled (ctx->stop set) or has passed ctx->deadline_us.
+ * calc_blocks() checks it between blocks and returns once the threads have
+ * finished the blocks they had, a calc_next_block() reader checks it itself.
+ */
+int calc_stopped (struct prime_ctx *ctx);
+
 int calc_blocks (struct prime_ctx *ctx, int (*fn)(struct prime_thread_ctx *, void *), void *);
 
+/*
+ * As calc_blocks(), but fn runs on nconsumers threads of its own (with the
+ * index of the consumer) while the workers go on sieving, so a slow fn only
+ * holds up the sieving once the block buffers run out. The blocks come in no
+ * particular order, fn returns non-zero to stop.
+ */
+int calc_blocks_pipelined (struct prime_ctx *ctx, uint32_t nconsumers,
+                           int (*fn)(const struct prime_current_block *, uint32_t, void *), void *);
+
 /*
  * Test a block
  */
@@ -7,14 +7,17 @@
 #include "ctx.h"
 #include "plans.h"
 #include "prime.h"
+#include "prime_count.h"
+#include "pool.h"
+#include "wide.h"
 
 
 /*
  * Count the number of primes in the block (the number of bits not set)
  */
-static uint64_t
-count_block (struct prime_current_block *block) {
-   uint64_t    *p = (uint64_t *)block->block;
+static uint64_t KERNEL_CLONES
+count_block (const struct prime_current_block *block) {
+   const uint64_t *p = (const uint64_t *)block->block;
    int          c = block->block_size >> 3;
    uint64_t count;
 
@@ -56,23 +59,157 @@ adjust_for_early_counts (struct prime_ctx *ctx)
 
 }
 
+/*
+ * The blocks a thread counted, as spans of consecutive blocks. A thread works
+ * through each of its runs in order, so there is a span per run.
+ */
+struct counted_span {
+   uint64_t first;
+   uint64_t end;                /* Exclusive */
+   uint64_t count;
+};
+
+
+struct counted_spans {
+   struct counted_span *spans;
+   uint32_t             num;
+   uint32_t             size;
+};
+
+
+/* One cache line per thread */
 struct counts {
-   union {
-      char padding[64];
-      struct {
-         uint64_t count;
-         uint64_t spin;
-         sem_t s1;
-      };
-   };
-}__attribute__((__packed__));
+   uint64_t count;
+   struct counted_spans done;
+}__attribute__((aligned(64)));
+
+
+/* How far back to look for a span a block carries on */
+#define SPAN_LOOKBACK 64
+
+static int count_consumers = 0;
+
+
+/*
+ * Blocks handed to consumers can be counted a little out of order, so a span
+ * which grows up to the start of a later one takes it over.
+ */
+static void
+add_counted_block (struct counted_spans *cs, uint64_t block_num, uint64_t count)
+{
+   uint32_t i;
+   uint32_t k;
+
+   for (i = cs->num; i > 0 && i + SPAN_LOOKBACK > cs->num; i--) {
+      if (cs->spans[i - 1].end != block_num)
+         continue;
+
+      cs->spans[i - 1].end++;
+      cs->spans[i - 1].count += count;
+
+      for (k = cs->num; k > 0 && k + SPAN_LOOKBACK > cs->num; k--) {
+         if (cs->spans[k - 1].first == block_num + 1) {
+            cs->spans[i - 1].end = cs->spans[k - 1].end;
+            cs->spans[i - 1].count += cs->spans[k - 1].count;
+            memmove(&cs->spans[k - 1], &cs->spans[k], sizeof *cs->spans * (cs->num - k));
+            cs->num--;
+            break;
+         }
+      }
+      return;
+   }
+
+   if (cs->num == cs->size) {
+      cs->size = MAX(16, cs->size * 2);
+      cs->spans = realloc(cs->spans, sizeof *cs->spans * cs->size);
+   }
+   cs->spans[cs->num++] = (struct counted_span){ block_num, block_num + 1, count };
+}
+
+
+static int
+cmp_span (const void *a, const void *b)
+{
+   const struct counted_span *sa = a;
+   const struct counted_span *sb = b;
+
+   return sa->first < sb->first ? -1 : sa->first > sb->first;
+}
+
+
+/*
+ * The count of the blocks done from the first without a gap, as the spans
+ * don't overlap. Returns the block after them.
+ */
+static uint64_t
+count_leading_spans (struct counts *counts, int n, uint64_t first_block, uint64_t *count)
+{
+   struct counted_span *all;
+   uint64_t next = first_block;
+   uint32_t num = 0;
+   uint32_t i;
+   int      k;
+
+   for (k = 0; k < n; k++)
+      num += counts[k].done.num;
+
+   all = malloc(sizeof *all * (num + 1));
+   for (k = 0, num = 0; k < n; k++)
+      for (i = 0; i < counts[k].done.num; i++)
+         all[num++] = counts[k].done.spans[i];
+   qsort(all, num, sizeof *all, cmp_span);
+
+   *count = 0;
+   for (i = 0; i < num && all[i].first == next; i++) {
+      *count += all[i].count;
+      next = all[i].end;
+   }
+
+   free(all);
+   return next;
+}
+
+
+static void
+free_counts (struct counts *counts, int n)
+{
+   int k;
+
+   for (k = 0; k < n; k++)
+      FREE(counts[k].done.spans);
+   free(counts);
+}
 
 
 static int
 count_thr (struct prime_thread_ctx *ptx, void *th)
 {
    struct counts *counts = th;
-   counts[ptx->thread_index].count += count_block(&ptx->current_block);
+   uint64_t       count = count_block(&ptx->current_block);
+
+   counts[ptx->thread_index].count += count;
+   add_counted_block(&counts[ptx->thread_index].done, ptx->current_block.block_num, count);
+   return 0;
+}
+
+
+/*
+ * The blocks of a run are spread over the consumers, so they share one set of
+ * spans (the first entry) where each run's blocks carry on a span.
+ */
+static pthread_mutex_t consumed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+count_consumed (const struct prime_current_block *pcb, uint32_t consumer, void *th)
+{
+   struct counts *counts = th;
+   uint64_t       count = count_block(pcb);
+
+   counts[consumer].count += count;
+
+   pthread_mutex_lock(&consumed_lock);
+   add_counted_block(&counts[0].done, pcb->block_num, count);
+   pthread_mutex_unlock(&consumed_lock);
    return 0;
 }
 
@@ -107,94 +244,305 @@ print_times (struct prime_ctx *ctx)
 }
 
 
-int
-getprimecount (int plan_index, uint64_t start, uint64_t end, uint64_t *count, int nthreads, int inorder) {
-   struct prime_ctx ctx;
-   int i;
+/*
+ * How the blocks were shared between the threads. A thread's idle time is
+ * the time it spent without a block, waiting for its turn in order or for the
+ * others to finish.
+ */
+static void
+print_thread_stats (struct prime_ctx *ctx)
+{
+   uint32_t i;
+
+   fprintf(stderr, "%6s %10s %12s\n", "Thread", "  Blocks", "  Idle (us)");
+   for (i = 0; i < ctx->num_threads; i++)
+      fprintf(stderr, "%6u %10"PRIu64" %12"PRIu64"\n", i, ctx->threads[i].blocks_done, ctx->threads[i].idle.r_diff);
+}
 
-   struct counts *counts;
 
-   init_context(&ctx, start, end, nthreads, get_prime_plan(plan_index));
+/*
+ * A stopped run only has the blocks from the first without a gap, so the
+ * numbers after them are taken off the end of the run.
+ */
+static void
+set_partial_result (struct prime_ctx *ctx, uint64_t next_block, uint64_t count, struct prime_run *run)
+{
+   struct prime_current_block last = ctx->threads[0].current_block;
+
+   run->complete = next_block > ctx->last_block_num;
+   run->counted = next_block > ctx->first_block_num;
+   run->end = ctx->run_info.end_num;
+   ctx->results.count = count;
+
+   if (!run->complete && run->counted) {
+      last.block_size = ctx->block_size * ctx->max_block_multiplier;
+      pcb_set_block(&last, next_block - 1);
+      run->end = MIN(last.block_end_num, ctx->run_info.end_num);
+      ctx->run_info.end_num = run->end;
+   }
+}
+
+
+static void
+count_context (struct prime_ctx *ctx, int inorder, struct prime_run *run)
+{
+   int nthreads = ctx->num_threads;
+   int n;
+   uint64_t next_block;
+   uint64_t count;
+
+   struct counts *counts;
 
    if (nthreads == 0 || inorder) {
-      while (calc_next_block(&ctx))
-         ctx.results.count += count_block(ctx.current_block);
+      next_block = 0;
+      count = 0;
+      while (!calc_stopped(ctx) && calc_next_block(ctx)) {
+         count += count_block(ctx->current_block);
+         next_block = ctx->current_block->block_num + 1;
+      }
+      stop_calc_next_block(ctx);
+      set_partial_result(ctx, ctx->stop ? next_block : ctx->last_block_num + 1, count, run);
 
-      print_times(&ctx);
+      print_times(ctx);
+      if (nthreads)
+         print_thread_stats(ctx);
    }
    else {
-      counts = calloc(sizeof *counts, nthreads);
+      n = count_consumers ? count_consumers : nthreads;
+      counts = aligned_alloc(64, sizeof *counts * n);
+      memset(counts, 0, sizeof *counts * n);
 
-      calc_blocks(&ctx, count_thr, counts);
-      for (i = 0; i < nthreads; i++)
-         ctx.results.count += counts[i].count;
+      if (count_consumers)
+         calc_blocks_pipelined(ctx, count_consumers, count_consumed, counts);
+      else
+         calc_blocks(ctx, count_thr, counts);
 
-      free(counts);
+      next_block = count_leading_spans(counts, n, ctx->first_block_num, &count);
+      set_partial_result(ctx, next_block, count, run);
+
+      free_counts(counts, n);
+      print_thread_stats(ctx);
    }
 
-   adjust_for_early_counts(&ctx);
-   *count = ctx.results.count;
+   if (run->counted)
+      adjust_for_early_counts(ctx);
+   run->count = ctx->results.count;
+}
+
+
+void
+set_count_consumers (int nconsumers)
+{
+   count_consumers = nconsumers;
+}
+
+
+void
+init_prime_run (struct prime_run *run, uint64_t deadline_ms)
+{
+   memset(run, 0, sizeof *run);
+   run->deadline_ms = deadline_ms;
+   pthread_mutex_init(&run->lock, NULL);
+}
+
+
+void
+free_prime_run (struct prime_run *run)
+{
+   pthread_mutex_destroy(&run->lock);
+}
+
+
+int
+getprimecount_run (struct prime_run *run, struct prime_pool *pool, int nthreads, int plan_index, uint64_t start, uint64_t end, int inorder, uint32_t block_size)
+{
+   struct prime_ctx ctx;
+
+   clock_gettime(CLOCK_MONOTONIC, &run->started);
+
+   if (pool)
+      init_context_pool(&ctx, start, end, pool, get_prime_plan(plan_index), block_size);
+   else
+      init_context(&ctx, start, end, nthreads, get_prime_plan(plan_index), block_size);
+
+   if (run->deadline_ms)
+      ctx.deadline_us = (uint64_t)run->started.tv_sec * 1000000 + run->started.tv_nsec / 1000 + run->deadline_ms * 1000;
+
+   pthread_mutex_lock(&run->lock);
+   ctx.stop = run->cancel;
+   run->ctx = &ctx;
+   pthread_mutex_unlock(&run->lock);
+
+   count_context(&ctx, inorder, run);
+
+   pthread_mutex_lock(&run->lock);
+   run->ctx = NULL;
+   pthread_mutex_unlock(&run->lock);
 
    free_context(&ctx);
    return 0;
 }
 
 
+void
+prime_run_cancel (struct prime_run *run)
+{
+   pthread_mutex_lock(&run->lock);
+   run->cancel = 1;
+   if (run->ctx)
+      __atomic_store_n(&run->ctx->stop, 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&run->lock);
+}
+
+
+void
+prime_run_progress (struct prime_run *run, struct prime_progress *progress)
+{
+   struct prime_ctx *ctx;
+   struct timespec   now;
+   uint64_t          numbers;
+   uint32_t          i;
+
+   memset(progress, 0, sizeof *progress);
+
+   pthread_mutex_lock(&run->lock);
+   if ((ctx = run->ctx) != NULL && ctx->last_block_num) {
+      for (i = 0; i < MAX(1, ctx->num_threads); i++)
+         progress->blocks_done += __atomic_load_n(&ctx->threads[i].blocks_done, __ATOMIC_RELAXED);
+
+      progress->num_blocks = ctx->last_block_num + 1 - ctx->first_block_num;
+      numbers = ctx->run_info.end_num - ctx->run_info.start_num;
+      progress->numbers_done = MIN(numbers, progress->blocks_done * ctx->block_size * ctx->max_block_multiplier * 30);
+   }
+   pthread_mutex_unlock(&run->lock);
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   progress->elapsed = (now.tv_sec - run->started.tv_sec) + (now.tv_nsec - run->started.tv_nsec) / 1e9;
+   progress->remaining = progress->blocks_done == 0 ? -1
+                       : progress->elapsed * (progress->num_blocks - MIN(progress->num_blocks, progress->blocks_done)) / progress->blocks_done;
+}
+
+
+int
+getprimecount (int plan_index, uint64_t start, uint64_t end, uint64_t *count, int nthreads, int inorder, uint32_t block_size) {
+   struct prime_run run;
+
+   init_prime_run(&run, 0);
+   getprimecount_run(&run, NULL, nthreads, plan_index, start, end, inorder, block_size);
+   *count = run.count;
+   free_prime_run(&run);
+   return 0;
+}
+
+
+int
+getprimecount_pool (struct prime_pool *pool, int plan_index, uint64_t start, uint64_t end, uint64_t *count, int inorder, uint32_t block_size) {
+   struct prime_run run;
+
+   init_prime_run(&run, 0);
+   getprimecount_run(&run, pool, 0, plan_index, start, end, inorder, block_size);
+   *count = run.count;
+   free_prime_run(&run);
+   return 0;
+}
+
+
+int
+getprimecount_wide (uint128_t start, uint128_t end, uint64_t *count, int nthreads, uint32_t block_size) {
+   struct wide_ctx ctx;
+
+   init_wide_context(&ctx, start, end, nthreads, block_size);
+
+   *count = 0;
+   while (calc_next_wide_block(&ctx))
+      *count += count_block(&ctx.current_block);
+
+   free_wide_context(&ctx);
+   return 0;
+}
+
+
 /*
  * Debug mode - compare the times and results of the two prime plans
+ *
+ * The plans can use different block sizes (ie block multipliers), in which
+ * case each block of the larger is compared to several of the smaller.
  */
 int
-getprimecount_cmp_plan (uint64_t start, uint64_t end, uint64_t *count, int ind1, int ind2, int nthreads)
+getprimecount_cmp_plan (uint64_t start, uint64_t end, uint64_t *count, int ind1, int ind2, int nthreads, uint32_t block_size)
 {
    const struct prime_plan *pp_1 = get_prime_plan(ind1);
    const struct prime_plan *pp_2 = get_prime_plan(ind2);
    struct timespot s1, s2;
    int i;
+   uint32_t k;
+   uint32_t ratio;
    struct prime_ctx ctx_1, ctx_2;
+   struct prime_ctx *big, *small;
+   char *big_block;
 
-   init_context(&ctx_1, start, end, nthreads, pp_1);
-   init_context(&ctx_2, start, end, nthreads, pp_2);
+   init_context(&ctx_1, start, end, nthreads, pp_1, block_size);
+   init_context(&ctx_2, start, end, nthreads, pp_2, block_size);
 
-   /* Can't compare unless block_size is the same */
-   assert(ctx_1.run_info.num_blocks == ctx_2.run_info.num_blocks);
+   if (ctx_1.current_block->block_size >= ctx_2.current_block->block_size) {
+      big = &ctx_1;
+      small = &ctx_2;
+   }
+   else {
+      big = &ctx_2;
+      small = &ctx_1;
+   }
+
+   /* Can't compare unless the smaller block size divides the larger */
+   assert(big->current_block->block_size % small->current_block->block_size == 0);
    init_time(&s2);
 
-   while (calc_next_block(&ctx_1)) {
-      init_time(&s1);
-      mark_time(&s1);
-      mark_time(&s2);
+   ratio = big->current_block->block_size / small->current_block->block_size;
+
+   while (calc_next_block(big)) {
+      for (k = 0; k < ratio; k++) {
+         init_time(&s1);
+         mark_time(&s1);
+         mark_time(&s2);
 
-      fprintf(stderr, "Calculating block %"PRIu64" %3.1f%%: ", ctx_1.current_block->block_start_num, (ctx_1.current_block->block_start_num - ctx_1.run_info.adjusted_start_num) * 100.0 / ((ctx_1.run_info.adjusted_end_num - ctx_1.run_info.adjusted_start_num)+ 1));
-      fflush(stderr);
+         /* The first block of the larger can start before that of the smaller */
+         if (big->current_block->block_num * ratio + k < num_to_bytes(start) / small->current_block->block_size)
+            continue;
 
-      if (calc_next_block(&ctx_2) == 0)
-         exit_error("plan 2 finished earlier");
+         big_block = big->current_block->block + k * small->current_block->block_size;
 
-      ctx_2.results.count += count_block(ctx_2.current_block);
+         if (calc_next_block(small) == 0)
+            break;
 
-      add_timediff(&s1);
-      add_timediff(&s2);
-      fprintf(stderr, " "TIME_DIFF_FMT_US" : "TIME_DIFF_FMT_MS"\n", TIME_DIFF_VALUES_US(&s1), TIME_DIFF_VALUES_MS(&s2));
+         fprintf(stderr, "Calculating block %"PRIu64" %3.1f%%: ", small->current_block->block_start_num, (small->current_block->block_start_num - small->run_info.adjusted_start_num) * 100.0 / ((small->run_info.adjusted_end_num - small->run_info.adjusted_start_num)+ 1));
+         fflush(stderr);
+
+         small->results.count += count_block(small->current_block);
+
+         add_timediff(&s1);
+         add_timediff(&s2);
+         fprintf(stderr, " "TIME_DIFF_FMT_US" : "TIME_DIFF_FMT_MS"\n", TIME_DIFF_VALUES_US(&s1), TIME_DIFF_VALUES_MS(&s2));
 #ifdef SLOW_TEST_PRIMES
-      slow_test_primes(&ctx_2);
+         slow_test_primes(small);
 #endif
 
-      if (memcmp(ctx_1.current_block->block, ctx_2.current_block->block, ctx_1.current_block->block_size) != 0) {
-         for (i = 0; i < (int)ctx_1.current_block->block_size; i++) {
-            if (ctx_1.current_block->block[i] != ctx_2.current_block->block[i]) {
-               fprintf(stderr, "Differs first at byte %ld(%d) %02X vs %02X number from %lu\n", ctx_1.current_block->block_start_num/30 + i, i, ctx_1.current_block->block[i] & 0xFF, ctx_2.current_block->block[i] & 0xFF, ctx_1.current_block->block_start_num + i*30);
-               break;
+         if (memcmp(big_block, small->current_block->block, small->current_block->block_size) != 0) {
+            for (i = 0; i < (int)small->current_block->block_size; i++) {
+               if (big_block[i] != small->current_block->block[i]) {
+                  fprintf(stderr, "Differs first at byte %ld(%d) %02X vs %02X number from %lu\n", small->current_block->block_start_num/30 + i, i, big_block[i] & 0xFF, small->current_block->block[i] & 0xFF, small->current_block->block_start_num + i*30);
+                  break;
+               }
             }
-         }
 
-         slow_test_primes(&ctx_2);
-         exit_error("Different");
+            slow_test_primes(small);
+            exit_error("Different");
+         }
       }
    }
 
-   adjust_for_early_counts(&ctx_2);
+   adjust_for_early_counts(small);
 
-   *count = ctx_2.results.count;
+   *count = small->results.count;
 
    free_context(&ctx_1);
    free_context(&ctx_2);
@@ -1,10 +1,81 @@
-#ifndef _HARU_PRIME_H
-#define _HARU_PRIME_H
+#ifndef _HARU_PRIME_COUNT_H
+#define _HARU_PRIME_COUNT_H
 
 #include <inttypes.h>
+#include <pthread.h>
 
-int getprimecount (int plan_index, uint64_t start, uint64_t end, uint64_t *count, int nthreads, int inorder);
-int getprimecount_cmp_plan (uint64_t start, uint64_t end, uint64_t *count, int ind1, int ind2, int nthreads);
+#include "misc.h"
+
+struct prime_pool;
+struct prime_ctx;
+
+
+/*
+ * A count which can be watched and stopped from another thread while
+ * getprimecount_run() works through it.
+ *
+ * A stopped count (cancelled or past its deadline) finishes the blocks the
+ * threads have, and the result is the exact count from start up to 'end',
+ * the end of the blocks done without a gap from the start. 'counted' is 0 if
+ * no such block was done, and the count is then 0.
+ */
+struct prime_run
+{
+   uint64_t          deadline_ms;  /* Stop this long after starting, 0 for none */
+
+   /* The result */
+   uint64_t          count;
+   uint64_t          end;
+   int               counted;
+   int               complete;
+
+   /* Internal */
+   pthread_mutex_t   lock;
+   struct prime_ctx *ctx;          /* While counting */
+   struct timespec   started;
+   int               cancel;
+};
+
+
+struct prime_progress
+{
+   uint64_t blocks_done;
+   uint64_t num_blocks;
+   uint64_t numbers_done;
+   double   elapsed;               /* Seconds */
+   double   remaining;             /* Estimated from the rate so far, -1 until a block is done */
+};
+
+
+void init_prime_run (struct prime_run *run, uint64_t deadline_ms);
+void free_prime_run (struct prime_run *run);
+
+/* With pool NULL the count uses nthreads threads of its own, as getprimecount */
+int getprimecount_run (struct prime_run *run, struct prime_pool *pool, int nthreads, int plan_index, uint64_t start, uint64_t end, int inorder, uint32_t block_size);
+
+/* Can be called at any time, before or during the count */
+void prime_run_cancel (struct prime_run *run);
+
+/*
+ * Sums the threads' counters, each is only written by its thread so this
+ * doesn't slow the count. All zero before the sieving primes are found.
+ */
+void prime_run_progress (struct prime_run *run, struct prime_progress *progress);
+
+/* block_size is in bytes (see init_context), 0 uses the plan's block size */
+int getprimecount (int plan_index, uint64_t start, uint64_t end, uint64_t *count, int nthreads, int inorder, uint32_t block_size);
+/* As getprimecount, using the threads of the pool (see pool.h) */
+int getprimecount_pool (struct prime_pool *pool, int plan_index, uint64_t start, uint64_t end, uint64_t *count, int inorder, uint32_t block_size);
+/* For windows above 2^64, see wide.h for the limits */
+int getprimecount_wide (uint128_t start, uint128_t end, uint64_t *count, int nthreads, uint32_t block_size);
+int getprimecount_cmp_plan (uint64_t start, uint64_t end, uint64_t *count, int ind1, int ind2, int nthreads, uint32_t block_size);
+
+/*
+ * Threaded counts (not in order) started after this count the blocks on
+ * nconsumers threads of their own, see calc_blocks_pipelined(). 0 (default)
+ * counts each block on the thread that sieved it.
+ */
+void set_count_consumers (int nconsumers);
 
 #endif
 
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard.h"
+
+#include "misc.h"
+
+
+/* FNV-1a */
+static uint64_t
+hash_line(const char *str, size_t len)
+{
+   uint64_t h = 0xcbf29ce484222325ull;
+
+   while (len--) {
+      h ^= (unsigned char)*str++;
+      h *= 0x100000001b3ull;
+   }
+   return h;
+}
+
+
+static int
+cmp_shard_start(const void *a, const void *b)
+{
+   const struct shard_result *sa = a;
+   const struct shard_result *sb = b;
+
+   return sa->start < sb->start ? -1 : sa->start > sb->start;
+}
+
+
+int
+get_unit_range(uint64_t start, uint64_t end, uint64_t first_unit, uint64_t end_unit, uint64_t *s, uint64_t *e)
+{
+   first_unit = MAX(first_unit, start / SHARD_UNIT);
+   end_unit = MIN(end_unit, end / SHARD_UNIT + 1);
+
+   if (first_unit >= end_unit)
+      return 0;
+
+   /* The last unit of a range near 2^64 can end past it */
+   *s = MAX(start, first_unit * SHARD_UNIT);
+   *e = end_unit > end / SHARD_UNIT ? end : end_unit * SHARD_UNIT - 1;
+   return 1;
+}
+
+
+int
+get_shard_range(uint64_t start, uint64_t end, uint32_t i, uint32_t n, uint64_t *s, uint64_t *e)
+{
+   uint64_t first = start / SHARD_UNIT;
+   uint64_t units = end / SHARD_UNIT - first + 1;
+
+   return get_unit_range(start, end, first + (uint64_t)((uint128_t)units * i / n),
+                         first + (uint64_t)((uint128_t)units * (i + 1) / n), s, e);
+}
+
+
+void
+format_shard_result(const struct shard_result *sr, char *line, size_t size)
+{
+   char range[64];
+   int  len;
+
+   if (sr->counted)
+      snprintf(range, sizeof range, "%"PRIu64":%"PRIu64, sr->start, sr->end);
+   else
+      strcpy(range, "none");
+
+   len = snprintf(line, size, "shard of=%"PRIu64":%"PRIu64" range=%s count=%"PRIu64" plan=%d",
+                  sr->of_start, sr->of_end, range, sr->count, sr->plan);
+   snprintf(line + len, size - len, " check=%016"PRIx64"\n", hash_line(line, len));
+}
+
+
+int
+parse_shard_result(const char *line, struct shard_result *sr)
+{
+   const char *check;
+   uint64_t    h;
+   int         n = 0;
+
+   memset(sr, 0, sizeof *sr);
+
+   if (strncmp(line, "shard ", 6) != 0 || (check = strstr(line, " check=")) == NULL)
+      return 0;
+   if (sscanf(check, " check=%"SCNx64, &h) != 1 || h != hash_line(line, check - line))
+      return 0;
+
+   if (sscanf(line, "shard of=%"SCNu64":%"SCNu64" range=%"SCNu64":%"SCNu64" count=%"SCNu64" plan=%d%n",
+              &sr->of_start, &sr->of_end, &sr->start, &sr->end, &sr->count, &sr->plan, &n) == 6 && n) {
+      sr->counted = 1;
+      return 1;
+   }
+
+   return sscanf(line, "shard of=%"SCNu64":%"SCNu64" range=none count=%"SCNu64" plan=%d%n",
+                 &sr->of_start, &sr->of_end, &sr->count, &sr->plan, &n) == 4 && n;
+}
+
+
+/*
+ * Adds the shard lines of f to srs, all of the same range as the first.
+ * Returns -1 for a bad line.
+ */
+static int
+read_shard_lines(FILE *f, const char *name, struct shard_result **srs, size_t *num, size_t *size)
+{
+   struct shard_result sr;
+   char                line[SHARD_LINE_MAX];
+   int                 lineno = 0;
+
+   while (fgets(line, sizeof line, f)) {
+      lineno++;
+      if (strncmp(line, "shard ", 6) != 0)
+         continue;
+
+      if (!parse_shard_result(line, &sr)) {
+         fprintf(stderr, "%s:%d: bad shard line (or check)\n", name, lineno);
+         return -1;
+      }
+
+      if (*num && (sr.of_start != (*srs)[0].of_start || sr.of_end != (*srs)[0].of_end)) {
+         fprintf(stderr, "%s:%d: a shard of a different range\n", name, lineno);
+         return -1;
+      }
+
+      /* It covers nothing, anything it should have counted shows as a gap */
+      if (!sr.counted)
+         continue;
+
+      if (*num == *size) {
+         *size = MAX(16, *size * 2);
+         *srs = realloc(*srs, sizeof **srs * *size);
+      }
+      (*srs)[(*num)++] = sr;
+   }
+   return 0;
+}
+
+
+int
+merge_shard_results(FILE **files, const char **names, int nfiles, struct shard_result *total)
+{
+   struct shard_result *srs = NULL;
+   size_t               num = 0;
+   size_t               size = 0;
+   size_t               i;
+   int                  ret = -1;
+   int                  k;
+
+   memset(total, 0, sizeof *total);
+
+   for (k = 0; k < nfiles; k++)
+      if (read_shard_lines(files[k], names[k], &srs, &num, &size) < 0)
+         goto out;
+
+   if (num == 0) {
+      fprintf(stderr, "No shard lines\n");
+      goto out;
+   }
+
+   qsort(srs, num, sizeof *srs, cmp_shard_start);
+
+   if (srs[0].start != srs[0].of_start) {
+      fprintf(stderr, "Missing %"PRIu64" to %"PRIu64"\n", srs[0].of_start, srs[0].start - 1);
+      goto out;
+   }
+
+   for (i = 0; i < num; i++) {
+      if (i > 0 && srs[i].start <= srs[i-1].end) {
+         fprintf(stderr, "Overlap at %"PRIu64" to %"PRIu64"\n", srs[i].start, MIN(srs[i].end, srs[i-1].end));
+         goto out;
+      }
+      if (i > 0 && srs[i].start != srs[i-1].end + 1) {
+         fprintf(stderr, "Missing %"PRIu64" to %"PRIu64"\n", srs[i-1].end + 1, srs[i].start - 1);
+         goto out;
+      }
+      total->count += srs[i].count;
+   }
+
+   if (srs[num-1].end != srs[0].of_end) {
+      fprintf(stderr, "Missing %"PRIu64" to %"PRIu64"\n", srs[num-1].end + 1, srs[0].of_end);
+      goto out;
+   }
+
+   total->of_start = total->start = srs[0].of_start;
+   total->of_end = total->end = srs[0].of_end;
+   total->plan = srs[0].plan;
+   total->counted = 1;
+   ret = num;
+
+out:
+   free(srs);
+   return ret;
+}
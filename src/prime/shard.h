@@ -0,0 +1,68 @@
+#ifndef _HARU_SHARD_H
+#define _HARU_SHARD_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+/**
+ * @FILE Splitting a count over separate processes, and putting it back together
+ *
+ * A range is cut on a fixed grid of SHARD_UNIT numbers, which is a whole
+ * number of blocks for every plan and block size, so no shard starts or ends
+ * part way through a block and the shards are the same whatever each process
+ * runs with. Shard i of n gets its share of the grid units the range covers.
+ *
+ * Each shard prints one line:
+ *
+ *   shard of=<min>:<max> range=<start>:<end> count=<count> plan=<plan> check=<hex>
+ *
+ * 'of' is the whole range being split, 'range' what this shard counted
+ * (inclusive, or "none"). check is a hash of the rest of the line, to catch
+ * lines which have been cut short or mixed up along the way.
+ */
+
+/* 30 numbers per byte, the largest blocks times the largest block multiplier */
+#define SHARD_UNIT ((uint64_t)30 * 1024 * 1024 * 8)
+
+#define SHARD_LINE_MAX 256
+
+
+struct shard_result
+{
+   uint64_t of_start;
+   uint64_t of_end;
+   uint64_t start;
+   uint64_t end;
+   uint64_t count;
+   int      counted;     /* 0 for range=none */
+   int      plan;
+};
+
+
+/*
+ * The numbers of shard i of n of start..end. Returns 0 if the shard is empty
+ * (more shards than grid units).
+ */
+int get_shard_range(uint64_t start, uint64_t end, uint32_t i, uint32_t n, uint64_t *s, uint64_t *e);
+
+/*
+ * The numbers of grid units first_unit up to end_unit (exclusive), counting
+ * from 0, that are within start..end. Returns 0 if there are none.
+ */
+int get_unit_range(uint64_t start, uint64_t end, uint64_t first_unit, uint64_t end_unit, uint64_t *s, uint64_t *e);
+
+/* The shard line for sr, with the newline */
+void format_shard_result(const struct shard_result *sr, char *line, size_t size);
+
+/* Returns 0 if the line isn't a shard line or its check doesn't match */
+int parse_shard_result(const char *line, struct shard_result *sr);
+
+/*
+ * Reads the shard lines of the files (other lines are skipped) and checks they
+ * cover their 'of' range exactly once between them. Sets the total count and
+ * range and returns the number of shards, or prints what is wrong (with the
+ * file's name) to stderr and returns -1.
+ */
+int merge_shard_results(FILE **files, const char **names, int nfiles, struct shard_result *total);
+
+#endif
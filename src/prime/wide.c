@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "wide.h"
+
+#include "misc.h"
+#include "plans.h"
+#include "wheel.h"
+#include "ctx.h"
+#include "prime.h"
+#include "cpus.h"
+
+
+/******************************************************************************
+ * STATIC FUNCTIONS
+ *****************************************************************************/
+
+static uint64_t
+isqrt_wide(uint128_t num)
+{
+   uint64_t r = sqrtl((long double)num);
+
+   while ((uint128_t)r * r > num)
+      r--;
+   while ((uint128_t)(r + 1) * (r + 1) <= num)
+      r++;
+   return r;
+}
+
+
+/*
+ * num % prime as a single 128/64 bit divide. The top half is reduced first so
+ * the quotient fits in 64 bits.
+ */
+static inline uint64_t
+mod_wide(uint128_t num, uint64_t prime)
+{
+#if defined(__x86_64__)
+   uint64_t hi = (uint64_t)(num >> 64);
+   uint64_t lo = (uint64_t)num;
+   uint64_t q;
+   uint64_t r;
+
+   if (hi >= prime)
+      hi %= prime;
+   __asm__ ("divq %4" : "=a" (q), "=d" (r) : "a" (lo), "d" (hi), "rm" (prime));
+   return r;
+#else
+   return num % prime;
+#endif
+}
+
+
+static struct wide_small_prime *
+push_small_prime(struct wide_ctx *wctx, uint64_t prime)
+{
+   if (wctx->small_primes_count == wctx->small_primes_size) {
+      wctx->small_primes_size *= 2;
+      wctx->small_primes = realloc(wctx->small_primes, sizeof(struct wide_small_prime) * wctx->small_primes_size);
+   }
+   wctx->small_primes[wctx->small_primes_count].prime = prime;
+   return &wctx->small_primes[wctx->small_primes_count++];
+}
+
+
+/* The inverse mod 30 of each possible prime, to find (base / prime) % 30 */
+static const unsigned char inverse_mod_30[30] = {
+   0, 1, 0, 0, 0, 0, 0,13, 0, 0, 0,11, 0, 7, 0, 0, 0,23, 0,19, 0, 0, 0,17, 0, 0, 0, 0, 0,29
+};
+
+/* The gap from each b bit to the next */
+static const unsigned char wheel_gaps[8] = { 6, 4, 2, 4, 2, 4, 6, 2 };
+
+
+/*
+ * The primes smaller than a block hit every block, so the next offset for
+ * each b bit is kept and they are marked one block at a time. Only the thread
+ * with the first sieving block sees these.
+ */
+static void
+add_small_sieve_prime(struct wide_ctx *wctx, uint64_t prime)
+{
+   struct wide_small_prime *sp = push_small_prime(wctx, prime);
+   uint64_t a_byte = num_to_bytes(prime);
+   uint32_t a_bit  = pp_to_bit(prime);
+   uint64_t start  = prime - mod_wide(wctx->base_byte, prime);
+   uint64_t off;
+   int      b_bit;
+
+   /* a * b = a * b_byte * 30 + a_byte * b_bit_val + a_bit_val * b_bit_val */
+   for (b_bit = 0; b_bit < 8; b_bit++) {
+      off = start + a_byte * ind_to_mod[b_bit] + a_x_b_bytes[a_bit][b_bit];
+      off -= off >= prime ? prime : 0;
+      sp->offsets[(int)mod_to_ind[ind_to_mod[a_bit] * ind_to_mod[b_bit] % 30]] = off;
+   }
+}
+
+
+/*
+ * The other primes are marked straight into the window, which can be done by
+ * all the threads at once.
+ *
+ * The first multiple prime * b >= base comes from a single base % prime. As
+ * base is a multiple of 30, b % 30 follows from the remainder, and from there
+ * the multiples step through the b bits. Most primes are larger than the
+ * window so this is usually the only multiple looked at.
+ */
+static inline void __attribute__((always_inline))
+add_wide_sieve_prime(struct wide_ctx *wctx, uint64_t prime, const int atomic)
+{
+   uint64_t rem = mod_wide(wctx->base, prime);
+   uint64_t num = rem ? prime - rem : 0;   /* prime * b - base */
+   uint32_t b   = ((30 - rem % 30) * inverse_mod_30[prime % 30] + (rem != 0)) % 30;
+   uint32_t b_bit = mod_to_ind[b];
+   unsigned char mask;
+
+   if (prime < wctx->current_block.block_size) {
+      add_small_sieve_prime(wctx, prime);
+      return;
+   }
+
+   for (num += prime * (ind_to_mod[b_bit] - b); num < wctx->window_nums; num += prime * wheel_gaps[b_bit], b_bit = (b_bit + 1) & 7) {
+      mask = 1 << pp_to_bit(num);
+      if (atomic)
+         __sync_fetch_and_or(wctx->window + num_to_bytes(num), mask);
+      else
+         wctx->window[num_to_bytes(num)] |= mask;
+   }
+}
+
+
+/*
+ * Like get_next_prime() in a loop, but a word at a time since every prime in
+ * the block is used
+ */
+static inline void __attribute__((always_inline))
+add_wide_sieve_primes_atomic(struct wide_ctx *wctx, struct prime_current_block *pcb, const int atomic)
+{
+   const uint64_t *words = (const uint64_t *)pcb->block;
+   uint64_t prime;
+   uint64_t w;
+   uint32_t i;
+   int      bit;
+
+   for (i = 0; i < pcb->block_size / 8; i++) {
+      for (w = ~words[i]; w; w &= w - 1) {
+         bit = __builtin_ctzll(w);
+         prime = pcb->block_start_num + bytes_to_num(i * 8 + bit / 8) + ind_to_mod[bit % 8];
+         add_wide_sieve_prime(wctx, prime, atomic);
+      }
+   }
+}
+
+
+static void
+add_wide_sieve_primes(struct wide_ctx *wctx, struct prime_current_block *pcb, const int atomic)
+{
+   if (atomic)
+      add_wide_sieve_primes_atomic(wctx, pcb, 1);
+   else
+      add_wide_sieve_primes_atomic(wctx, pcb, 0);
+}
+
+
+static int
+add_wide_sieve_primes_thr(struct prime_thread_ctx *ptx, void *thunk)
+{
+   add_wide_sieve_primes(thunk, &ptx->current_block, 1);
+   return 0;
+}
+
+
+/*
+ * The sieving primes come from a normal run up to max_sieve_prime, using the
+ * threads if there are any.
+ */
+static void
+calc_wide_sieving_primes(struct wide_ctx *wctx)
+{
+   struct prime_ctx ctx;
+
+   init_context(&ctx, 0, wctx->max_sieve_prime, wctx->num_threads, get_prime_plan(0), 0);
+
+   if (wctx->num_threads == 0) {
+      while (calc_next_block(&ctx))
+         add_wide_sieve_primes(wctx, ctx.current_block, 0);
+   }
+   else {
+      calc_blocks(&ctx, add_wide_sieve_primes_thr, wctx);
+   }
+
+   free_context(&ctx);
+}
+
+
+static void
+mark_small_primes(struct wide_ctx *wctx)
+{
+   const unsigned char bits[] = {0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80};
+   struct prime_current_block *pcb = &wctx->current_block;
+   struct wide_small_prime *sp;
+   uint32_t off;
+   int i;
+
+   for (sp = wctx->small_primes; sp < wctx->small_primes + wctx->small_primes_count; sp++) {
+      for (i = 0; i < 8; i++) {
+         for (off = sp->offsets[i]; off < pcb->block_size; off += sp->prime)
+            pcb->block[off] |= bits[i];
+         sp->offsets[i] = off - pcb->block_size;
+      }
+   }
+}
+
+
+/*
+ * As apply_start_end_sets(), the numbers relative to base are small enough
+ * not to overflow.
+ */
+static void
+apply_wide_start_end_sets(struct wide_ctx *wctx)
+{
+   struct prime_current_block *pcb = &wctx->current_block;
+   uint64_t start = wctx->start_num - wctx->base;
+   uint64_t end   = wctx->end_num - wctx->base;
+   uint64_t byte;
+
+   if (pcb->block_start_num == 0)
+      pcb->block[0] |= (1u << num_to_bit(start)) - 1;
+
+   if (pcb->block_end_num > end) {
+      byte = num_to_bytes(end + 1) - pcb->block_start_byte;
+
+      if (byte < pcb->block_size) {
+         pcb->block[byte] |= ~0u << num_to_bit(end + 1);
+         memset(pcb->block + byte + 1, 0xff, pcb->block_size - byte - 1);
+      }
+   }
+}
+
+
+/******************************************************************************
+ *
+ * EXTERNAL FUNCTIONS
+ *
+ *****************************************************************************/
+
+void
+init_wide_context(struct wide_ctx *wctx, uint128_t start, uint128_t end, int nthreads, uint32_t block_size)
+{
+   memset(wctx, 0, sizeof *wctx);
+
+   block_size = block_size ?: get_prime_plan(0)->block_size;
+   assert(block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0);
+   assert(start <= end && end - start < WIDE_MAX_WIDTH && end < WIDE_MAX_END);
+
+   wctx->start_num       = start;
+   wctx->end_num         = end;
+   wctx->base_byte       = start / 30;
+   wctx->base            = wctx->base_byte * 30;
+   wctx->max_sieve_prime = isqrt_wide(end);
+   wctx->num_threads     = resolve_num_threads(nthreads);
+
+   wctx->num_blocks  = num_to_bytes(end - wctx->base) / block_size + 1;
+   wctx->window_size = wctx->num_blocks * block_size;
+   wctx->window_nums = bytes_to_num(wctx->window_size);
+   wctx->window      = aligned_alloc(4096, CEIL_TO(wctx->window_size, 4096));
+   memset(wctx->window, 0, wctx->window_size);
+
+   wctx->small_primes_size = 1024;
+   wctx->small_primes = malloc(sizeof(struct wide_small_prime) * wctx->small_primes_size);
+
+   wctx->current_block.block_size = block_size;
+}
+
+
+void
+free_wide_context(struct wide_ctx *wctx)
+{
+   FREE(wctx->small_primes);
+   FREE(wctx->window);
+   memset(wctx, 0, sizeof *wctx);
+}
+
+
+int
+calc_next_wide_block(struct wide_ctx *wctx)
+{
+   uint64_t block_num = wctx->current_block.block_num + 1;
+
+   if (wctx->run_state == 0) {
+      calc_wide_sieving_primes(wctx);
+      wctx->run_state = 1;
+      block_num = 0;
+   }
+
+   if (block_num >= wctx->num_blocks)
+      return 0;
+
+   pcb_set_block(&wctx->current_block, block_num);
+   wctx->current_block.block = wctx->window + wctx->current_block.block_start_byte;
+
+   mark_small_primes(wctx);
+   apply_wide_start_end_sets(wctx);
+   return 1;
+}
+
+
+uint128_t
+get_next_wide_prime(struct wide_ctx *wctx, uint32_t *byte, uint32_t *bit)
+{
+   uint64_t prime = get_next_prime(&wctx->current_block, byte, bit);
+   return prime ? wctx->base + prime : 0;
+}
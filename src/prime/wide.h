@@ -0,0 +1,76 @@
+#ifndef _HARU_WIDE_H
+#define _HARU_WIDE_H
+
+#include <inttypes.h>
+
+#include "misc.h"
+#include "wheel.h"
+
+/**
+ * @FILE Prime windows above 2^64
+ *
+ * The normal run keeps the numbers in a uint64_t and the sieving primes in a
+ * uint32_t. A wide run takes a window of up to WIDE_MAX_WIDTH numbers which
+ * can start anywhere below WIDE_MAX_END, so the sieving primes are up to 2^40.
+ *
+ * The blocks of a wide run hold numbers relative to 'base' (a multiple of 30),
+ * so the usual functions on the block (get_next_prime() etc) work as normal and
+ * 'base' is added to get the actual number.
+ *
+ * The whole window is kept in memory. The sieving primes are generated with a
+ * normal run and the larger ones are marked straight into the window as they
+ * are found, which only needs one 128 bit modulo per prime. The smaller primes,
+ * which hit every block, are marked one block at a time.
+ */
+
+#define WIDE_MAX_WIDTH ((uint64_t)1 << 34)
+#define WIDE_MAX_END   ((uint128_t)1 << 80)
+
+
+struct wide_small_prime
+{
+   uint32_t prime;
+   uint32_t offsets[8]; /* Offset of each bit from the start of the block */
+};
+
+
+struct wide_ctx
+{
+   uint128_t start_num;
+   uint128_t end_num;
+   uint128_t base;
+   uint128_t base_byte;
+   uint64_t  max_sieve_prime;
+   int       num_threads;
+
+   char     *window;
+   uint64_t  window_size;
+   uint64_t  window_nums;
+   uint64_t  num_blocks;
+
+   struct wide_small_prime   *small_primes;
+   uint32_t                   small_primes_count;
+   uint32_t                   small_primes_size;
+
+   struct prime_current_block current_block;
+   int                        run_state;
+};
+
+
+/*
+ * block_size is as for init_context(). The sieving primes are generated with
+ * nthreads threads, the blocks of the window are then calculated in order.
+ */
+void init_wide_context(struct wide_ctx *wctx, uint128_t start, uint128_t end, int nthreads, uint32_t block_size);
+void free_wide_context(struct wide_ctx *wctx);
+
+/*
+ * As calc_next_block(). Returns 0 once the window is done, otherwise
+ * wctx->current_block is the next block of the window.
+ */
+int calc_next_wide_block(struct wide_ctx *wctx);
+
+/* As get_next_prime() but returns the actual prime (0 at the end of the block) */
+uint128_t get_next_wide_prime(struct wide_ctx *wctx, uint32_t *byte, uint32_t *bit);
+
+#endif
@@ -4,29 +4,250 @@
 #include <inttypes.h>
 #include <math.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "prime_count.h"
+#include "wide.h"
+#include "cpus.h"
+#include "pool.h"
+#include "shard.h"
 
 #include "misc.h"
 
+static void
+usage(const char *prog)
+{
+   exit_error("Usage: %s [-b block_size] [-p pinning] [-c consumers] [-d seconds] [-s i/n | -u a:b] min max [plan] [nthreads] [inorder]\n"
+              "       %s merge [file...]\n"
+              "  -b block_size   bytes per block, a power of two from 16K to 1M (default from the plan)\n"
+              "  -c consumers    count the blocks on this many threads while the others sieve\n"
+              "  -d seconds      stop after this long, with the count up to where it got\n"
+              "  -p pinning      scatter (default), compact or none\n"
+              "  -s i/n          count shard i (from 0) of n and print a shard line\n"
+              "  -u a:b          count the shard of units a up to b of %"PRIu64" numbers\n"
+              "  nthreads        0 for single threaded, -1 for a thread per physical core\n"
+              "merge adds up the shard lines of the files (or stdin), checking they cover the range once\n"
+              "A threaded count takes one thread fewer on SIGUSR2 and one more (up to nthreads) on SIGRTMIN\n"
+              "SIGUSR1 prints the progress to stderr\n", prog, prog, SHARD_UNIT);
+}
+
+
+static int report_done;
+
+/*
+ * SIGUSR1 is blocked in every other thread, so it is picked up here with
+ * sigwait() and the progress can be printed without worrying about what is
+ * safe in a signal handler.
+ */
+static void *
+report_progress(void *data)
+{
+   struct prime_run      *run = data;
+   struct prime_progress  p;
+   sigset_t               set;
+   int                    sig;
+
+   sigemptyset(&set);
+   sigaddset(&set, SIGUSR1);
+
+   for (;;) {
+      sigwait(&set, &sig);
+      if (__atomic_load_n(&report_done, __ATOMIC_SEQ_CST))
+         return NULL;
+
+      prime_run_progress(run, &p);
+      fprintf(stderr, "Blocks %"PRIu64"/%"PRIu64", numbers %"PRIu64", %.1fs elapsed",
+              p.blocks_done, p.num_blocks, p.numbers_done, p.elapsed);
+      if (p.remaining >= 0)
+         fprintf(stderr, ", about %.1fs left", p.remaining);
+      fprintf(stderr, "\n");
+   }
+}
+
+
+static struct prime_pool *signal_pool;
+
+/*
+ * SIGUSR2 parks a thread and SIGRTMIN brings one back. Not the job control
+ * signals, which the terminal sends to a background run that writes to it.
+ */
+static void
+change_active_threads(int sig)
+{
+   prime_pool_set_active(signal_pool, signal_pool->active + (sig == SIGUSR2 ? -1 : 1));
+}
+
+
+static void
+count_with_pool(struct prime_run *run, int ind, uint64_t s, uint64_t max, int nthreads, int inorder, uint32_t block_size)
+{
+   struct prime_pool pool;
+   struct sigaction  sa;
+
+   init_prime_pool(&pool, nthreads);
+   signal_pool = &pool;
+
+   memset(&sa, 0, sizeof sa);
+   sa.sa_handler = change_active_threads;
+   sa.sa_flags = SA_RESTART;
+   sigaction(SIGUSR2, &sa, NULL);
+   sigaction(SIGRTMIN, &sa, NULL);
+
+   getprimecount_run(run, &pool, 0, ind, s, max, inorder, block_size);
+
+   sa.sa_handler = SIG_IGN;
+   sigaction(SIGUSR2, &sa, NULL);
+   sigaction(SIGRTMIN, &sa, NULL);
+   free_prime_pool(&pool);
+}
+
+
+static void
+count_with_run(struct prime_run *run, int ind, uint64_t s, uint64_t max, int nthreads, int inorder, uint32_t block_size)
+{
+   pthread_t reporter;
+   sigset_t  set;
+
+   sigemptyset(&set);
+   sigaddset(&set, SIGUSR1);
+   pthread_sigmask(SIG_BLOCK, &set, NULL);
+   pthread_create(&reporter, NULL, report_progress, run);
+
+   if (nthreads != 0)
+      count_with_pool(run, ind, s, max, nthreads, inorder, block_size);
+   else
+      getprimecount_run(run, NULL, 0, ind, s, max, inorder, block_size);
+
+   __atomic_store_n(&report_done, 1, __ATOMIC_SEQ_CST);
+   pthread_kill(reporter, SIGUSR1);
+   pthread_join(reporter, NULL);
+}
+
+
+static int
+merge_shards(int nfiles, char *names[])
+{
+   struct shard_result total;
+   const char        **fnames;
+   FILE              **files;
+   int                 num;
+   int                 k;
+
+   if (nfiles == 0) {
+      FILE       *in = stdin;
+      const char *name = "stdin";
+
+      num = merge_shard_results(&in, &name, 1, &total);
+   }
+   else {
+      files = calloc(nfiles, sizeof *files);
+      fnames = calloc(nfiles, sizeof *fnames);
+      for (k = 0; k < nfiles; k++) {
+         if ((files[k] = fopen(names[k], "r")) == NULL)
+            exit_error("Can't open %s\n", names[k]);
+         fnames[k] = names[k];
+      }
+
+      num = merge_shard_results(files, fnames, nfiles, &total);
+
+      for (k = 0; k < nfiles; k++)
+         fclose(files[k]);
+      free(files);
+      free(fnames);
+   }
+
+   if (num < 0)
+      return EXIT_FAILURE;
+
+   printf("%"PRIu64" from %d shards of %"PRIu64" to %"PRIu64"\n", total.count, num, total.start, total.end);
+   return EXIT_SUCCESS;
+}
+
+
 int
 main (int argc, char *argv[])
 {
-   uint64_t max;
-   uint64_t s;
+   uint128_t max;
+   uint128_t s;
    uint64_t count;
+   uint64_t block_size = 0;
+   uint64_t deadline_ms = 0;
+   struct prime_run run;
    int ind = 0;
    int nthreads = 0;
    int inorder = 0;
+   int opt;
+   int pin;
+   int consumers;
+   int shard = 0;
+   uint32_t shard_i = 0;
+   uint32_t shard_n = 0;
+   uint64_t unit_a = 0;
+   uint64_t unit_b = 0;
+   uint64_t shard_s = 0;
+   uint64_t shard_e = 0;
+   int shard_empty = 0;
+   const char *prog = argv[0];
    struct timespot ts;
 
-   bzero(&ts, sizeof ts);
+   memset(&ts, 0, sizeof ts);
+
+   if (argc > 1 && strcmp(argv[1], "merge") == 0)
+      return merge_shards(argc - 2, argv + 2);
+
+   while ((opt = getopt(argc, argv, "+b:p:c:d:s:u:")) != -1) {
+      switch (opt) {
+         case 'b':
+            block_size = parse_num(optarg);
+            if (block_size < 16*1024 || block_size > 1024*1024 || (block_size & (block_size - 1)) != 0)
+               exit_error("block_size (%"PRIu64") must be a power of two from 16K to 1M\n", block_size);
+            break;
+         case 'p':
+            if ((pin = parse_cpu_pinning(optarg)) < 0)
+               exit_error("pinning (%s) must be scatter, compact or none\n", optarg);
+            set_cpu_pinning(pin);
+            break;
+         case 'c':
+            if ((consumers = strtol(optarg, NULL, 0)) < 0)
+               exit_error("consumers (%s) can't be negative\n", optarg);
+            set_count_consumers(consumers);
+            break;
+         case 'd':
+            deadline_ms = strtod(optarg, NULL) * 1000;
+            if (deadline_ms == 0)
+               exit_error("seconds (%s) must be more than 0\n", optarg);
+            break;
+         case 's':
+            if (sscanf(optarg, "%"SCNu32"/%"SCNu32, &shard_i, &shard_n) != 2 || shard_i >= shard_n)
+               exit_error("shard (%s) must be i/n with i below n\n", optarg);
+            shard = 's';
+            break;
+         case 'u':
+            if (sscanf(optarg, "%"SCNu64":%"SCNu64, &unit_a, &unit_b) != 2 || unit_a >= unit_b)
+               exit_error("units (%s) must be a:b with a below b\n", optarg);
+            shard = 'u';
+            break;
+         default:
+            usage(prog);
+      }
+   }
+   argc -= optind - 1;
+   argv += optind - 1;
 
    if (argc < 3)
-      exit_error("Usage: %s min max [plan] [nthreads] [inorder]\n", argv[0]);
+      usage(prog);
+
+   s = parse_wide_num(argv[1]);
+   max = parse_wide_num(argv[2]);
+
+   if (s > max)
+      exit_error("min (%s) is larger than max (%s)\n", argv[1], argv[2]);
+
+   if (max > UINT64_MAX && (max >= WIDE_MAX_END || max - s >= WIDE_MAX_WIDTH))
+      exit_error("Above 2^64 max must be below 2^80 and max - min below 2^34\n");
 
-   s = strtol(argv[1], NULL, 0);
-   max = strtol(argv[2], NULL, 0);
    if (argc > 3)
       ind = strtol(argv[3], NULL, 0);
 
@@ -36,11 +257,64 @@ main (int argc, char *argv[])
    if (argc > 5)
       inorder = strtol(argv[5], NULL, 0);
 
+   if (shard && max > UINT64_MAX)
+      exit_error("Shards must be below 2^64\n");
+
+   if (shard == 's')
+      shard_empty = !get_shard_range(s, max, shard_i, shard_n, &shard_s, &shard_e);
+   else if (shard == 'u')
+      shard_empty = !get_unit_range(s, max, unit_a, unit_b, &shard_s, &shard_e);
+
+   init_prime_run(&run, deadline_ms);
+   run.complete = 1;
+
    mark_time(&ts);
-   getprimecount(ind, s, max, &count, nthreads, inorder);
+   if (shard_empty)
+      count = 0;
+   else if (shard)
+      count_with_run(&run, ind, shard_s, shard_e, nthreads, inorder, block_size);
+   else if (max > UINT64_MAX)
+      getprimecount_wide(s, max, &count, nthreads, block_size);
+   else {
+      count_with_run(&run, ind, s, max, nthreads, inorder, block_size);
+      count = run.count;
+   }
    add_timediff(&ts);
 
-   printf("%"PRIu64" "TIME_DIFF_FMT_MS"\n", count, TIME_DIFF_VALUES_MS(&ts));
+   if (shard) {
+      struct shard_result sr;
+      char                line[SHARD_LINE_MAX];
+
+      memset(&sr, 0, sizeof sr);
+      sr.of_start = s;
+      sr.of_end = max;
+      sr.plan = ind;
+      if (!shard_empty && run.counted) {
+         sr.start = shard_s;
+         sr.end = run.end;
+         sr.count = run.count;
+         sr.counted = 1;
+      }
+      format_shard_result(&sr, line, sizeof line);
+      fputs(line, stdout);
+
+      fprintf(stderr, TIME_DIFF_FMT_MS, TIME_DIFF_VALUES_MS(&ts));
+      if (!run.complete)
+         fprintf(stderr, " stopped, the shard is incomplete");
+      fprintf(stderr, "\n");
+
+      free_prime_run(&run);
+      return EXIT_SUCCESS;
+   }
+
+   printf("%"PRIu64" "TIME_DIFF_FMT_MS, count, TIME_DIFF_VALUES_MS(&ts));
+   if (!run.complete && run.counted)
+      printf(" stopped, counted up to %"PRIu64, run.end);
+   else if (!run.complete)
+      printf(" stopped before counting any block");
+   printf("\n");
+
+   free_prime_run(&run);
 
    return EXIT_SUCCESS;
 }
@@ -17,19 +17,26 @@ main (int argc, char *argv[])
    int plan_0;
    int plan_1;
    int nthreads = 0;
+   uint32_t block_size = 0;
 
    if (argc < 5)
-      exit_error("usage: %s min max plan_0 plan_1 nthreads\n", argv[0]);
+      exit_error("usage: %s min max plan_0 plan_1 [nthreads] [block_size]\n", argv[0]);
 
 
-   s = strtol(argv[1], NULL, 0);
-   max = strtol(argv[2], NULL, 0);
+   s = parse_num(argv[1]);
+   max = parse_num(argv[2]);
+
+   if (s > max)
+      exit_error("min (%"PRIu64") is larger than max (%"PRIu64")\n", s, max);
+
    plan_0 = atoi(argv[3]);
    plan_1 = atoi(argv[4]);
    if (argc > 5)
       nthreads = atoi(argv[5]);
+   if (argc > 6)
+      block_size = parse_num(argv[6]);
 
-   getprimecount_cmp_plan(s, max, &count, plan_0, plan_1, nthreads);
+   getprimecount_cmp_plan(s, max, &count, plan_0, plan_1, nthreads, block_size);
 
    printf ("%"PRIu64"\n", count);
 